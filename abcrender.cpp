@@ -1,32 +1,45 @@
 #include "abcrender.h"
+#include "transform.h"
+#include "clip.h"
+#include "imagewriter.h"
+#include "framewriter.h"
 #include <stdio.h>
 #include <Magick++.h>
 #include <future>
-
-static void accumXform( M44d &xf, const IObject obj, chrono_t seconds )
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <condition_variable>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static double seconds_between(std::chrono::steady_clock::time_point start,
+                              std::chrono::steady_clock::time_point end)
 {
-    if (IXform::matches( obj.getHeader()))  {
-        IXform x(obj, kWrapExisting);
-        XformSample xs;
-        ISampleSelector sel(seconds);
-        x.getSchema().get(xs, sel);
-        xf *= xs.getMatrix();
-    }
+    return std::chrono::duration<double>(end - start).count();
 }
 
-
-static M44d get_final_matrix( const IObject &iObj, chrono_t seconds )
+static double seconds_since(std::chrono::steady_clock::time_point start)
 {
-    M44d xf;
-    xf.makeIdentity();
-    IObject parent = iObj.getParent();
+    return seconds_between(start, std::chrono::steady_clock::now());
+}
 
-    while (parent) {
-        accumXform(xf, parent, seconds);
-        parent = parent.getParent();
-    }
+#define FPS 24.0
 
-    return xf;
+// HDF5 isn't thread safe, every archive of that kind shares this lock
+static std::mutex &hdf5_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
 }
 
 static glm::mat4 get_camera_projection_matrix(const ICamera &camera,
@@ -47,39 +60,133 @@ static glm::mat4 get_camera_projection_matrix(const ICamera &camera,
     return persp_matrix;
 }
 
-static void read_object(IObject object, std::vector<IPolyMesh> &mesh_list, std::vector<ICamera> &camera_list)
+// xform nodes are added before their children, so update_xforms can
+// evaluate them in order.
+void ABCRender::read_object(IObject object, int parent)
 {
     const size_t child_count = object.getNumChildren();
     for (size_t i = 0; i < child_count; ++i) {
         const ObjectHeader& child_header = object.getChildHeader(i);
+        int child_parent = parent;
         if (IPolyMesh::matches(child_header)) {
             mesh_list.push_back(IPolyMesh(object, child_header.getName()));
+            m_mesh_xform.push_back(parent);
         } else if (ICamera::matches(child_header)) {
             camera_list.push_back(ICamera(object, child_header.getName()));
+            m_camera_xform.push_back(parent);
+        } else if (IXform::matches(child_header)) {
+            XformNode node;
+            node.xform = IXform(object, child_header.getName());
+            node.parent = parent;
+            node.constant = node.xform.getSchema().isConstant() &&
+                            (parent < 0 || m_xforms[parent].constant);
+            m_xforms.push_back(node);
+            child_parent = (int)m_xforms.size() - 1;
         }
-        read_object(object.getChild(i), mesh_list, camera_list);
+        read_object(object.getChild(i), child_parent);
     }
 
 }
 
-ABCRender::ABCRender(const std::string &abc_path)
+void ABCRender::update_xforms(double seconds)
 {
+    ISampleSelector sel(seconds);
+    for (size_t i = 0; i < m_xforms.size(); i++) {
+        XformNode &node = m_xforms[i];
+        if (node.constant && node.evaluated)
+            continue;
+
+        XformSample xs;
+        node.xform.getSchema().get(xs, sel);
+        node.world = xs.getMatrix();
+        if (node.parent >= 0)
+            node.world *= m_xforms[node.parent].world;
+        node.evaluated = true;
+    }
+}
+
+M44d ABCRender::world_matrix(int xform) const
+{
+    M44d xf;
+    xf.makeIdentity();
+    if (xform >= 0)
+        xf = m_xforms[xform].world;
+    return xf;
+}
+
+// changes whenever the file is replaced or written to, so samples cached
+// for an older version of an archive are never found again
+static std::string archive_stamp(const std::string &path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return std::string();
+
+    std::ostringstream stamp;
+    stamp << info.st_dev << ":" << info.st_ino << ":" << info.st_size << ":" << info.st_mtime;
+    return stamp.str();
+}
+
+ABCRender::ABCRender(const std::string &abc_path, int streams)
+{
+    m_culled_meshes = 0;
+    m_frame = 0;
+    m_bytes_read = 0;
+    trace = NULL;
+    sample_cache = NULL;
+
+    // the kind of archive is only known once it is open
+    std::unique_lock<std::mutex> lock(hdf5_mutex());
     AbcF::IFactory factory;
     factory.setPolicy(Abc::ErrorHandler::kQuietNoopPolicy);
+    factory.setOgawaNumStreams(std::max(streams, 1));
     AbcF::IFactory::CoreType coreType;
     m_archive = factory.getArchive(abc_path, coreType);
-    read_object(m_archive.getTop(), mesh_list, camera_list);
+    m_hdf5 = coreType == AbcF::IFactory::kHDF5;
+    read_object(m_archive.getTop(), -1);
+    m_mesh_cache.resize(mesh_list.size());
+    std::string archive = abc_path + ":" + archive_stamp(abc_path);
+    for (size_t i = 0; i < mesh_list.size(); i++)
+        m_mesh_cache[i].object = archive + ":" + mesh_list[i].getFullName();
+}
+
+// the archive's objects are let go of before the members holding them are
+// destroyed, so HDF5 handles aren't released while another reader is in
+// render()
+ABCRender::~ABCRender()
+{
+    std::unique_lock<std::mutex> lock(hdf5_mutex(), std::defer_lock);
+    if (m_hdf5)
+        lock.lock();
+
+    m_mesh_cache.clear();
+    m_xforms.clear();
+    mesh_list.clear();
+    camera_list.clear();
+    m_archive.reset();
 }
 
 void ABCRender::render(RenderContext &ctx, int frame)
 {
     int width = ctx.width();
     int height = ctx.height();
-    double seconds = frame / 24.0;
+    double seconds = frame / FPS;
 
     const ICamera &camera= camera_list[0];
-
-    M44d xf = get_final_matrix(camera, seconds);
+    m_frame = frame;
+    m_bytes_read = 0;
+
+    // everything that touches the archive happens before the first
+    // triangle is drawn, so HDF5 archives only hold the lock that long
+    std::unique_lock<std::mutex> lock(hdf5_mutex(), std::defer_lock);
+    if (m_hdf5)
+        lock.lock();
+
+    {
+        TraceSpan span(trace, "xforms", frame);
+        update_xforms(seconds);
+    }
+    M44d xf = world_matrix(m_camera_xform[0]);
     m_view_matrix = glm::inverse(glm::make_mat4(&xf[0][0]));
     m_projection_matrix = get_camera_projection_matrix(camera, width, height, seconds);
 
@@ -87,22 +194,39 @@ void ABCRender::render(RenderContext &ctx, int frame)
     m_screen_matrix = glm::scale(m_screen_matrix, glm::vec3(width/2.0f, height/2.0f, 1.0f));
     m_screen_matrix = glm::translate(m_screen_matrix, glm::vec3(1.0, 1.0, 0));
 
-    for (int i= 0; i < mesh_list.size(); i++) {
-        draw_mesh(ctx, mesh_list[i], seconds);
+    m_times = RenderTimes();
+    read_meshes(ctx.pool, seconds);
+
+    if (m_hdf5)
+        lock.unlock();
+
+    for (size_t i = 0; i < m_visible_meshes.size(); i++) {
+        draw_mesh(ctx, m_visible_meshes[i]);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        TraceSpan span(trace, "raster", frame);
+        ctx.flush();
+    }
+    {
+        TraceSpan span(trace, "resolve", frame);
+        ctx.resolve();
     }
+    m_times.raster += seconds_since(start);
 }
 
-void ABCRender::read_uvs(const IPolyMeshSchema::Sample& m_sample,
-                         const IPolyMeshSchema &m_schema,
+void ABCRender::read_uvs(const IPolyMeshSchema &m_schema,
+                         const ISampleSelector &sel,
+                         size_t face_indices,
                          std::vector<glm::vec2> &uvs) {
-    size_t face_indices = m_sample.getFaceIndices()->size();
     IV2fGeomParam uv_param = m_schema.getUVsParam();
     if (!uv_param.valid()) {
         uvs.resize(face_indices);
         return;
     }
 
-    IV2fGeomParam::Sample uv_sample(uv_param.getIndexedValue());
+    IV2fGeomParam::Sample uv_sample(uv_param.getIndexedValue(sel));
     if (!uv_sample.valid()){
         uvs.resize(face_indices);
         return;
@@ -111,10 +235,12 @@ void ABCRender::read_uvs(const IPolyMeshSchema::Sample& m_sample,
     const V2f *uv = uv_sample.getVals()->get();
     const size_t uv_count = uv_sample.getVals()->size();
     //cerr << "     reading uvs " << uv_count << "\n";
+    m_bytes_read += uv_count * sizeof(V2f);
 
     if (uv_param.isIndexed()) {
         UInt32ArraySamplePtr indices_obj = uv_sample.getIndices();
         int indices_count = indices_obj->size();
+        m_bytes_read += indices_count * sizeof(uint32_t);
         //cerr << "     mesh has indexed uvs = " << indices_count << "\n";
 
         for (size_t i = 0; i < indices_count; i++) {
@@ -132,32 +258,39 @@ void ABCRender::read_uvs(const IPolyMeshSchema::Sample& m_sample,
     }
 }
 
-void ABCRender::read_normals(const IPolyMeshSchema::Sample& m_sample,
-                             const IPolyMeshSchema &m_schema,
-                             std::vector<glm::vec3> &normals)
+bool ABCRender::read_normals(const IPolyMeshSchema &m_schema,
+                             const ISampleSelector &sel,
+                             const P3fArraySamplePtr &positions,
+                             const Int32ArraySamplePtr &faceIndices,
+                             const Int32ArraySamplePtr &faceCounts,
+                             std::vector<glm::vec3> &normals,
+                             ThreadPool *pool)
 {
     IN3fGeomParam normal_param = m_schema.getNormalsParam();
-    size_t face_indices = m_sample.getFaceIndices()->size();
 
     if (!normal_param.valid()) {
-        create_normals(m_sample, m_schema, normals);
-        return;
+        TraceSpan span(trace, "normals", m_frame);
+        create_normals(positions, faceIndices, faceCounts, normals, pool);
+        return false;
     }
 
-    IN3fGeomParam::Sample normal_sample(normal_param.getIndexedValue());
+    IN3fGeomParam::Sample normal_sample(normal_param.getIndexedValue(sel));
     if (!normal_sample.valid()) {
-        create_normals(m_sample, m_schema, normals);
-        return;
+        TraceSpan span(trace, "normals", m_frame);
+        create_normals(positions, faceIndices, faceCounts, normals, pool);
+        return false;
     }
 
     const N3f* n = normal_sample.getVals()->get();
     const size_t normal_count = normal_sample.getVals()->size();
 
     //cerr << "     reading normals " << normal_count << "\n";
+    m_bytes_read += normal_count * sizeof(N3f);
 
     if (normal_param.isIndexed()) {
         UInt32ArraySamplePtr indices_obj = normal_sample.getIndices();
         int indices_count = indices_obj->size();
+        m_bytes_read += indices_count * sizeof(uint32_t);
        // cerr << "   mesh has indexed normals = " << indices_count << "\n";
 
         for (size_t i = 0; i < indices_count; i++) {
@@ -173,146 +306,468 @@ void ABCRender::read_normals(const IPolyMeshSchema::Sample& m_sample,
         }
     }
 
+    return true;
 }
 
-struct SimpleVertex{
-    glm::vec3 vertex;
-    bool operator<(const SimpleVertex that) const{
-                    return memcmp((void*)this, (void*)&that, sizeof(SimpleVertex))>0;
-    };
+#define PARALLEL_CHUNK 4096
+
+// positions compare by their bits, like the old memcmp keyed map did
+struct PositionKey
+{
+    uint32_t bits[3];
+    bool operator==(const PositionKey &that) const {
+        return bits[0] == that.bits[0] &&
+               bits[1] == that.bits[1] &&
+               bits[2] == that.bits[2];
+    }
 };
 
-void ABCRender::create_normals(const IPolyMeshSchema::Sample& m_sample,
-                                const IPolyMeshSchema &m_schema,
-                                std::vector<glm::vec3> &normals)
+struct PositionHash
 {
-    const P3fArraySamplePtr &positions = m_sample.getPositions();
-    const Int32ArraySamplePtr &faceIndices = m_sample.getFaceIndices();
-    const Int32ArraySamplePtr &faceCounts = m_sample.getFaceCounts();
+    size_t operator()(const PositionKey &key) const {
+        size_t h = key.bits[0];
+        h = h * 0x9e3779b1u ^ key.bits[1];
+        h = h * 0x9e3779b1u ^ key.bits[2];
+        return h;
+    }
+};
 
-    std::map< SimpleVertex, std::vector< std::pair < unsigned int , glm::vec3 > >  > vertex_map;
-    std::map< SimpleVertex, std::vector< std::pair< unsigned int , glm::vec3 > > >::iterator it;
+// maps every point to the first point with the same position
+static void weld_points(const P3fArraySamplePtr &positions, std::vector<unsigned int> &slots)
+{
+    const size_t count = positions->size();
+    const Alembic::AbcGeom::V3f *p = positions->get();
 
-    //cacluate normals
-    unsigned int cur_index = 0;
-    for(int i =0; i < faceCounts->size(); i++) {
-        int face_size = faceCounts->get()[i];
+    std::unordered_map<PositionKey, unsigned int, PositionHash> first;
+    first.reserve(count);
+    slots.resize(count);
 
-        // degenerated faces
-        if (face_size < 3) {
-            for(int j=0; j< face_size; j++) {
-                normals.push_back(glm::vec3(0,0,0));
+    for (size_t i = 0; i < count; i++) {
+        PositionKey key;
+        memcpy(key.bits, &p[i], sizeof(key.bits));
+        slots[i] = first.insert(std::make_pair(key, (unsigned int)i)).first->second;
+    }
+}
+
+static void parallel_chunks(ThreadPool *pool, size_t count,
+                            const std::function<void(size_t, size_t)> &func)
+{
+    int chunks = (int)((count + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK);
+    std::function<void(int)> job = [&](int chunk) {
+        size_t begin = (size_t)chunk * PARALLEL_CHUNK;
+        func(begin, std::min(begin + PARALLEL_CHUNK, count));
+    };
+
+    if (pool)
+        pool->parallel_for(chunks, job);
+    else
+        for (int i = 0; i < chunks; i++)
+            job(i);
+}
+
+void ABCRender::create_normals(const P3fArraySamplePtr &positions,
+                               const Int32ArraySamplePtr &faceIndices,
+                               const Int32ArraySamplePtr &faceCounts,
+                               std::vector<glm::vec3> &normals,
+                               ThreadPool *pool)
+{
+    const size_t face_count = faceCounts->size();
+    const int32_t *counts = faceCounts->get();
+    const int32_t *indices = faceIndices->get();
+    const Alembic::AbcGeom::V3f *p = positions->get();
+
+    std::vector<unsigned int> face_start(face_count + 1);
+    face_start[0] = 0;
+    for (size_t i = 0; i < face_count; i++)
+        face_start[i + 1] = face_start[i] + counts[i];
+
+    // normal of the first triangle of every face
+    std::vector<glm::vec3> face_normals(face_count);
+    parallel_chunks(pool, face_count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (counts[i] < 3)
+                continue;
+
+            glm::vec3 poly[3];
+            for (int j = 0; j < 3; j++) {
+                const Alembic::AbcGeom::V3f v = p[indices[face_start[i] + j]];
+                poly[j] = glm::vec3(v.x, v.y, v.z);
             }
-            cur_index += face_size;
-            continue;
+
+            glm::vec3 ab = poly[1] - poly[0];
+            glm::vec3 ac = poly[2] - poly[0];
+            face_normals[i] = glm::normalize(glm::cross(ac, ab));
         }
+    });
 
-        glm::vec3 poly[3];
+    std::vector<unsigned int> slots;
+    weld_points(positions, slots);
 
-        // get just the first normal
-        for(int j =0; j < 3; j++) {
-            unsigned int index = (unsigned int)(*faceIndices)[cur_index + j];
-            const Alembic::AbcGeom::V3f p = positions->get()[index];
-            poly[j] = glm::vec3(p.x, p.y, p.z);
-        }
+    // summed in face-vertex order, the same order the map used
+    std::vector<glm::vec3> sums(slots.size(), glm::vec3(0, 0, 0));
+    std::vector<unsigned int> uses(slots.size(), 0);
+    for (size_t i = 0; i < face_count; i++) {
+        if (counts[i] < 3)
+            continue;
 
-        // caculate the normal
-        glm::vec3 ab = poly[1] - poly[0];
-        glm::vec3 ac = poly[2] - poly[0];
-        glm::vec3 wn = glm::normalize(glm::cross(ac, ab));
-
-        for(int j=0; j< face_size; j++) {
-            unsigned int index = (unsigned int)(*faceIndices)[cur_index + j];
-            const Alembic::AbcGeom::V3f p = positions->get()[index];
-            SimpleVertex vert = {glm::vec3(p.x, p.y, p.z)};
-            vertex_map[vert].push_back( std::pair< unsigned int ,
-                                        glm::vec3>(cur_index + j, wn) );
+        for (unsigned int j = face_start[i]; j < face_start[i + 1]; j++) {
+            unsigned int slot = slots[indices[j]];
+            sums[slot] += face_normals[i];
+            uses[slot]++;
         }
-
-        cur_index += face_size;
     }
 
-    // finally average the normals
-    normals.resize(cur_index);
-    for (it = vertex_map.begin(); it != vertex_map.end(); it++) {
-        glm::vec3 a;
-        for (int i = 0; i < it->second.size(); i ++) {
-             a +=  it->second[i].second;
+    // degenerated faces get no normal
+    normals.resize(face_start[face_count]);
+    parallel_chunks(pool, face_count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            for (unsigned int j = face_start[i]; j < face_start[i + 1]; j++) {
+                unsigned int slot = slots[indices[j]];
+                if (counts[i] < 3)
+                    normals[j] = glm::vec3(0, 0, 0);
+                else
+                    normals[j] = sums[slot] / (float)uses[slot];
+            }
         }
+    });
+}
 
-        a /= it->second.size();
-        for (int i = 0; i < it->second.size(); i ++) {
-            normals[it->second[i].first] = a;
-        }
+// true when all 8 corners are outside the same clip plane
+static bool outside_frustum(const Box3d &box, const glm::mat4 &mat)
+{
+    int outside[6] = {0, 0, 0, 0, 0, 0};
+
+    for (int i = 0; i < 8; i++) {
+        glm::vec4 p((i & 1) ? box.max.x : box.min.x,
+                    (i & 2) ? box.max.y : box.min.y,
+                    (i & 4) ? box.max.z : box.min.z,
+                    1.0);
+        p = mat * p;
+
+        if (p.x < -p.w) outside[0]++;
+        if (p.x >  p.w) outside[1]++;
+        if (p.y < -p.w) outside[2]++;
+        if (p.y >  p.w) outside[3]++;
+        if (p.z < -p.w) outside[4]++;
+        if (p.z >  p.w) outside[5]++;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        if (outside[i] == 8)
+            return true;
     }
+    return false;
 }
 
-void ABCRender::draw_mesh(RenderContext &ctx,
-                          const IPolyMesh &mesh,
-                          double seconds)
+bool ABCRender::mesh_culled(size_t index, const ISampleSelector &sel) const
 {
-    IPolyMeshSchema schema = mesh.getSchema();
+    IBox3dProperty bounds_prop = mesh_list[index].getSchema().getSelfBoundsProperty();
+    if (!bounds_prop.valid())
+        return false;
 
-    ISampleSelector sel(seconds );
-    IPolyMeshSchema::Sample sampler;
-    schema.get(sampler, sel);
+    Box3d bounds = bounds_prop.getValue(sel);
+    M44d xf = world_matrix(m_mesh_xform[index]);
+    glm::mat4 model_matrix = glm::make_mat4(&xf[0][0]);
+    return !bounds.isEmpty() &&
+           outside_frustum(bounds, m_projection_matrix * m_view_matrix * model_matrix);
+}
 
-    std::vector<glm::vec2> uvs;
-    std::vector<glm::vec3> normals;
+// fills the cache of every mesh inside the camera. Ogawa archives read
+// them all at once, each read takes one of the archive's streams.
+void ABCRender::read_meshes(ThreadPool *pool, double seconds)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ISampleSelector sel(seconds);
+
+    // skip meshes outside the camera before reading any of their samples
+    m_culled_meshes = 0;
+    m_visible_meshes.clear();
+    for (size_t i = 0; i < mesh_list.size(); i++) {
+        if (mesh_culled(i, sel))
+            m_culled_meshes++;
+        else
+            m_visible_meshes.push_back(i);
+    }
 
-    read_uvs(sampler, schema, uvs);
-    read_normals(sampler, schema, normals);
+    // the pool's workers can't take the exception with them
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    std::function<void(int)> job = [&](int i) {
+        size_t index = m_visible_meshes[i];
+        try {
+            TraceSpan span(trace, "read", m_frame);
+            if (trace)
+                span.set_detail(mesh_list[index].getName());
+            read_geometry(mesh_list[index].getSchema(), sel, m_mesh_cache[index], pool);
+        } catch (...) {
+            std::unique_lock<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
 
-    const P3fArraySamplePtr &positions = sampler.getPositions();
-    const Int32ArraySamplePtr &faceIndices = sampler.getFaceIndices();
-    const Int32ArraySamplePtr &faceCounts = sampler.getFaceCounts();
+    if (pool && !m_hdf5)
+        pool->parallel_for(m_visible_meshes.size(), job);
+    else
+        for (size_t i = 0; i < m_visible_meshes.size(); i++)
+            job(i);
 
-    unsigned int cur_index = 0;
+    m_times.read += seconds_since(start);
+    if (error)
+        std::rethrow_exception(error);
+}
 
-    std::pair<unsigned int, unsigned int> *p;
-    std::pair<unsigned int, unsigned int> face_indices[3];
-    Vertex polygon[3];
+void ABCRender::draw_mesh(RenderContext &ctx, size_t index)
+{
+    MeshCache &cache = m_mesh_cache[index];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-    M44d xf = get_final_matrix(mesh, seconds);
+    M44d xf = world_matrix(m_mesh_xform[index]);
     glm::mat4 model_matrix = glm::make_mat4(&xf[0][0]);
 
+    const P3fArraySamplePtr &positions = cache.positions;
+    const Int32ArraySamplePtr &faceIndices = cache.topology->face_indices;
+    const std::vector<unsigned int> &triangles = cache.topology->triangles;
+    const std::vector<glm::vec2> &uvs = *cache.uvs;
+    const std::vector<glm::vec3> &normals = *cache.normals;
+
     glm::mat4 mat =  m_screen_matrix * m_projection_matrix * m_view_matrix * model_matrix;
 
-    for(size_t i =0; i < faceCounts->size(); i++) {
-        int face_size = faceCounts->get()[i];
-        p = &face_indices[0];
-        p->first = cur_index;
-        p->second = (unsigned int)(*faceIndices)[p->first];
-
-        for (int j = 1; j < face_size -1; j++) {
-            p = &face_indices[1];
-            p->first = cur_index + j;
-            p->second = (unsigned int)(*faceIndices)[p->first];
-
-            p = &face_indices[2];
-            p->first = cur_index + j + 1;
-            p->second = (unsigned int)(*faceIndices)[p->first];
-            for (int k = 0; k < 3; k++) {
-                p = &face_indices[k];
-                const Alembic::AbcGeom::V3f vert = positions->get()[p->second];
-                glm::vec4 pos(vert.x, vert.y, vert.z, 1.0);
-                polygon[k].pos = mat * pos;
-                polygon[k].uv = uvs[p->first];
-                polygon[k].normal = normals[p->first];
-
-                polygon[k].pos.x /= polygon[k].pos.w;
-                polygon[k].pos.y /= polygon[k].pos.w;
-                polygon[k].pos.z /= polygon[k].pos.w;
+    // every point is transformed once, triangles gather from the buffer
+    {
+        TraceSpan span(trace, "transform", m_frame);
+        const float *points = (const float*)positions->get();
+        m_points.resize(positions->size());
+        m_clip_codes.resize(positions->size());
+        parallel_chunks(ctx.pool, m_points.size(), [&](size_t begin, size_t end) {
+            transform_points(mat, points + begin * 3, end - begin,
+                             (float)ctx.width(), (float)ctx.height(),
+                             &m_points[begin], &m_clip_codes[begin]);
+        });
+    }
 
-            }
+    std::chrono::steady_clock::time_point transform_done = std::chrono::steady_clock::now();
+    m_times.transform += seconds_between(start, transform_done);
+
+    TraceSpan span(trace, "triangles", m_frame);
+    const Alembic::AbcGeom::V3f *p = positions->get();
+    Vertex polygon[3];
+    Vertex clipped[CLIP_MAX_VERTICES];
+
+    for(size_t i = 0; i + 2 < triangles.size(); i += 3) {
+        unsigned int points[3];
+        for (int k = 0; k < 3; k++)
+            points[k] = (unsigned int)(*faceIndices)[triangles[i + k]];
+
+        unsigned int all_codes = m_clip_codes[points[0]] | m_clip_codes[points[1]] | m_clip_codes[points[2]];
+        if (m_clip_codes[points[0]] & m_clip_codes[points[1]] & m_clip_codes[points[2]])
+            continue;
+
+        for (int k = 0; k < 3; k++) {
+            unsigned int corner = triangles[i + k];
+            polygon[k].pos = m_points[points[k]];
+            polygon[k].uv = uvs[corner];
+            polygon[k].normal = normals[corner];
+        }
+
+        if (!all_codes) {
             ctx.draw_triangle(polygon[0], polygon[1], polygon[2]);
+            continue;
+        }
+
+        // crosses the near plane or the guard band, clip the undivided
+        // positions and draw the polygon as a fan
+        for (int k = 0; k < 3; k++) {
+            const Alembic::AbcGeom::V3f &v = p[points[k]];
+            polygon[k].pos = transform_position(mat, v.x, v.y, v.z);
         }
+        int count = clip_triangle(polygon, (float)ctx.width(), (float)ctx.height(), clipped);
+        for (int k = 1; k + 1 < count; k++)
+            ctx.draw_triangle(clipped[0], clipped[k], clipped[k + 1]);
+    }
+
+    m_times.raster += seconds_since(transform_done);
+}
+
+template <class PROP>
+static index_t sample_index(const PROP &prop, const ISampleSelector &sel)
+{
+    return sel.getIndex(prop.getTimeSampling(), prop.getNumSamples());
+}
+
+static void hash_value(uint64_t &hash, uint64_t value)
+{
+    // FNV-1a
+    for (int i = 0; i < 8; i++) {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= 1099511628211ull;
+    }
+}
+
+uint64_t ABCRender::fingerprint(int frame)
+{
+    std::unique_lock<std::mutex> lock(hdf5_mutex(), std::defer_lock);
+    if (m_hdf5)
+        lock.lock();
+
+    ISampleSelector sel(frame / FPS);
+    uint64_t hash = 14695981039346656037ull;
+
+    hash_value(hash, sample_index(camera_list[0].getSchema(), sel));
+    for (size_t i = 0; i < m_xforms.size(); i++)
+        hash_value(hash, sample_index(m_xforms[i].xform.getSchema(), sel));
+
+    for (size_t i = 0; i < mesh_list.size(); i++) {
+        IPolyMeshSchema schema = mesh_list[i].getSchema();
+        hash_value(hash, sample_index(schema.getPositionsProperty(), sel));
+        hash_value(hash, sample_index(schema.getFaceIndicesProperty(), sel));
+        hash_value(hash, sample_index(schema.getFaceCountsProperty(), sel));
+
+        IV2fGeomParam uv_param = schema.getUVsParam();
+        hash_value(hash, uv_param.valid() ? sample_index(uv_param, sel) : -1);
+        IN3fGeomParam normal_param = schema.getNormalsParam();
+        hash_value(hash, normal_param.valid() ? sample_index(normal_param, sel) : -1);
+    }
+    return hash;
+}
+
+static std::string sample_key(const std::string &object, const char *property,
+                              index_t a, index_t b = 0, index_t c = 0)
+{
+    std::ostringstream key;
+    key << object << ":" << property << ":" << a << ":" << b << ":" << c;
+    return key.str();
+}
+
+template <class T>
+static std::shared_ptr<T> find_sample(SampleCache *sample_cache, const std::string &key)
+{
+    return sample_cache ? sample_cache->find<T>(key) : std::shared_ptr<T>();
+}
+
+static void keep_sample(SampleCache *sample_cache, const std::string &key,
+                        const std::shared_ptr<void> &value, size_t bytes)
+{
+    if (sample_cache)
+        sample_cache->insert(key, value, bytes);
+}
+
+// only re-reads the properties whose sample index changed since the last
+// frame, constant topology, uvs and normals are read once per render.
+// Samples another reader already decoded come from the sample cache.
+void ABCRender::read_geometry(const IPolyMeshSchema &schema,
+                              const ISampleSelector &sel,
+                              MeshCache &cache,
+                              ThreadPool *pool)
+{
+    IP3fArrayProperty positions_prop = schema.getPositionsProperty();
+    IInt32ArrayProperty indices_prop = schema.getFaceIndicesProperty();
+    IInt32ArrayProperty counts_prop = schema.getFaceCountsProperty();
+
+    index_t positions_index = sample_index(positions_prop, sel);
+    index_t indices_index = sample_index(indices_prop, sel);
+    index_t counts_index = sample_index(counts_prop, sel);
+
+    bool positions_changed = !cache.positions || positions_index != cache.positions_index;
+    bool topology_changed = !cache.topology ||
+                            indices_index != cache.indices_index ||
+                            counts_index != cache.counts_index;
+
+    if (positions_changed) {
+        std::string key = sample_key(cache.object, "P", positions_index);
+        cache.positions = find_sample<P3fArraySamplePtr::element_type>(sample_cache, key);
+        if (!cache.positions) {
+            positions_prop.get(cache.positions, ISampleSelector(positions_index));
+            size_t bytes = cache.positions->size() * sizeof(V3f);
+            m_bytes_read += bytes;
+            keep_sample(sample_cache, key, cache.positions, bytes);
+        }
+        cache.positions_index = positions_index;
+    }
+
+    if (topology_changed) {
+        std::string key = sample_key(cache.object, "topology", indices_index, counts_index);
+        cache.topology = find_sample<MeshTopology>(sample_cache, key);
+        if (!cache.topology) {
+            std::shared_ptr<MeshTopology> topology(new MeshTopology());
+            indices_prop.get(topology->face_indices, ISampleSelector(indices_index));
+            counts_prop.get(topology->face_counts, ISampleSelector(counts_index));
+            size_t bytes = (topology->face_indices->size() + topology->face_counts->size()) * sizeof(int32_t);
+            m_bytes_read += bytes;
+
+            // fan triangulate, each entry is a face-vertex index
+            unsigned int cur_index = 0;
+            for (size_t i = 0; i < topology->face_counts->size(); i++) {
+                int face_size = topology->face_counts->get()[i];
+                for (int j = 1; j < face_size - 1; j++) {
+                    topology->triangles.push_back(cur_index);
+                    topology->triangles.push_back(cur_index + j);
+                    topology->triangles.push_back(cur_index + j + 1);
+                }
+                cur_index += face_size;
+            }
+
+            bytes += topology->triangles.size() * sizeof(unsigned int);
+            keep_sample(sample_cache, key, topology, bytes);
+            cache.topology = topology;
+        }
+        cache.indices_index = indices_index;
+        cache.counts_index = counts_index;
+    }
+
+    const MeshTopology &topology = *cache.topology;
+
+    IV2fGeomParam uv_param = schema.getUVsParam();
+    index_t uv_index = uv_param.valid() ? sample_index(uv_param, sel) : 0;
 
-        cur_index += face_size;
+    if (topology_changed || !cache.uvs || uv_index != cache.uv_index) {
+        // meshes without uvs get one zero uv per face-vertex
+        std::string key = sample_key(cache.object, "uv", uv_index, indices_index);
+        cache.uvs = find_sample<std::vector<glm::vec2> >(sample_cache, key);
+        if (!cache.uvs) {
+            std::shared_ptr<std::vector<glm::vec2> > uvs(new std::vector<glm::vec2>());
+            read_uvs(schema, ISampleSelector(uv_index), topology.face_indices->size(), *uvs);
+            keep_sample(sample_cache, key, uvs, uvs->size() * sizeof(glm::vec2));
+            cache.uvs = uvs;
+        }
+        cache.uv_index = uv_index;
     }
 
+    IN3fGeomParam normal_param = schema.getNormalsParam();
+    index_t normal_index = normal_param.valid() ? sample_index(normal_param, sel) : 0;
+
+    if (topology_changed || !cache.normals || normal_index != cache.normal_index ||
+            (cache.normals_from_positions && positions_changed)) {
+        // created normals depend on the positions and topology instead
+        bool created = !normal_param.valid();
+        std::string key = created ?
+            sample_key(cache.object, "created N", positions_index, indices_index, counts_index) :
+            sample_key(cache.object, "N", normal_index, indices_index);
+        cache.normals = find_sample<std::vector<glm::vec3> >(sample_cache, key);
+        cache.normals_from_positions = created;
+
+        if (!cache.normals) {
+            std::shared_ptr<std::vector<glm::vec3> > normals(new std::vector<glm::vec3>());
+            bool read = read_normals(schema, ISampleSelector(normal_index),
+                                     cache.positions,
+                                     topology.face_indices,
+                                     topology.face_counts,
+                                     *normals,
+                                     pool);
+            // a normals param without a valid sample falls back to created
+            // normals, which its key doesn't cover
+            if (read || created)
+                keep_sample(sample_cache, key, normals, normals->size() * sizeof(glm::vec3));
+            cache.normals_from_positions = !read;
+            cache.normals = normals;
+        }
+        cache.normal_index = normal_index;
+    }
 }
 
+#define MAX_PREFETCH_THREADS 4
+
 int format_string(const std::string &s, std::string &result, int frame)
 {
     char buffer[200];
@@ -341,92 +796,562 @@ static int read_imageplane(Magick::Image *image,
     image->read(formated_path);
     image->strip();
     image->attribute("colorspace", "srgb");
-    Magick::Geometry size(width, height);
-    size.aspect(true);
-    image->resize(size);
+    if ((int)image->columns() != width || (int)image->rows() != height) {
+        Magick::Geometry size(width, height);
+        size.aspect(true);
+        image->resize(size);
+    }
     return 0;
 }
 
-int abcrender(const std::string &abc_path,
-              const std::string &dest_path,
-              const std::string &image_path,
-              const std::string &texture_path,
-              int start_frame,
-              int end_frame,
-              int width,
-              int height)
+struct PlateRead
 {
-    ABCRender renderer(abc_path);
+    int frame;
+    Magick::Image image;
+    std::promise<void> promise;
+    // throws what the read threw
+    std::shared_future<void> ready;
+};
 
-    if (renderer.camera_list.empty()) {
-        std::cerr << "no cameras found" << std::endl;
-        return -1;
+// decodes image plane frames on its own threads, up to depth frames ahead
+// of the last one taken. Without read ahead a frame's read starts when
+// it is taken. Every frame in flight gets a thread, so their reads run at
+// the same time.
+class PlatePrefetch
+{
+public:
+    PlatePrefetch(const RenderOptions &options, int depth, Trace *trace) :
+        m_options(options),
+        m_trace(trace),
+        m_depth(depth),
+        m_ring(depth),
+        m_pool(std::min(std::max(depth, options.frames_in_flight), MAX_PREFETCH_THREADS))
+    {
+        int last = std::min(options.start_frame + depth - 1, options.end_frame);
+        for (int frame = options.start_frame; frame <= last; frame++)
+            m_ring[slot(frame)] = start_read(frame);
     }
 
-    if (renderer.mesh_list.empty()) {
-        std::cerr << "no mesh found" << std::endl;
-        return -1;
-    }
+    std::shared_ptr<PlateRead> take(int frame)
+    {
+        if (!m_depth)
+            return start_read(frame);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::shared_ptr<PlateRead> &entry = m_ring[slot(frame)];
 
-    RenderContext ctx(width, height);
-    RenderContext texture(0, 0);
+        // frame - depth still has to be taken by another render slot
+        while (!entry || entry->frame != frame)
+            m_cond.wait(lock);
 
-    if (!texture_path.empty()) {
-        Magick::Image texture_image(texture_path);
-        float tex_width = texture_image.size().width();
-        float tex_height = texture_image.size().height();
-        texture.resize(tex_width, tex_height);
-        texture_image.flip();
-        texture_image.write(0, 0, tex_width, tex_height, "RGBA",  Magick::FloatPixel, &texture.data[0]);
-        ctx.texture = &texture;
+        std::shared_ptr<PlateRead> read = entry;
+        entry.reset();
+        if (frame + m_depth <= m_options.end_frame)
+            entry = start_read(frame + m_depth);
+
+        m_cond.notify_all();
+        return read;
+    }
+
+private:
+    int slot(int frame) const {return (frame - m_options.start_frame) % m_depth;}
+
+    std::shared_ptr<PlateRead> start_read(int frame)
+    {
+        std::shared_ptr<PlateRead> read(new PlateRead());
+        read->frame = frame;
+        read->ready = read->promise.get_future().share();
+
+        const RenderOptions &options = m_options;
+        Trace *trace = m_trace;
+        m_pool.run([read, &options, trace]() {
+            try {
+                TraceSpan span(trace, "plate read", read->frame);
+                read_imageplane(&read->image, options.image_path, read->frame,
+                                options.width, options.height);
+                read->promise.set_value();
+            } catch (...) {
+                read->promise.set_exception(std::current_exception());
+            }
+        });
+        return read;
     }
 
+    const RenderOptions &m_options;
+    Trace *m_trace;
+    int m_depth;
+    std::vector<std::shared_ptr<PlateRead> > m_ring;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    ThreadPool m_pool;
+};
+
+// everything a frame's write needs once rendering has moved on
+struct FrameOutput
+{
+    int frame;
+    RenderContext *ctx;
+    std::string path;
+    std::shared_ptr<PlateRead> plate;
+    Trace *trace;
     std::chrono::time_point<std::chrono::system_clock> start;
-    std::chrono::duration<double> elapsed_seconds;
-    std::future<int> future;
+    std::ostringstream log;
+};
 
-    for (int i= start_frame; i < end_frame + 1; i++) {
+static int write_frame(FrameOutput &out, const RenderOptions &options)
+{
+    int width = options.width;
+    int height = options.height;
+    RenderContext &ctx = *out.ctx;
+
+    // an earlier run may have linked it to another frame's image, writing
+    // through the link would change both
+    unlink(out.path.c_str());
+
+    // Magick is only needed to composite over the plate or for formats
+    // write_image doesn't know.
+    if (!out.plate && native_image_format(out.path)) {
+        TraceSpan span(out.trace, "encode", out.frame);
+        if (!write_image(out.path, &ctx.data[0], width, height, options.write_options))
+            return -1;
+    } else {
         Magick::Image rendered_image;
-        Magick::Image image;
-        std::string out_image_path;
-
-        start = std::chrono::system_clock::now();
-        if (!image_path.empty()) {
-            future = std::async(std::launch::async, read_imageplane,
-                                &image, image_path, i, width, height);
-            //read_imageplane(&image, image_path, i);
+        rendered_image.read(width, height, "RGBA", Magick::FloatPixel, &ctx.data[0]);
+        rendered_image.flip();
+
+        Magick::Image &image = out.plate ? out.plate->image : rendered_image;
+        if (out.plate) {
+            {
+                TraceSpan span(out.trace, "plate wait", out.frame);
+                out.plate->ready.get();
+            }
+            TraceSpan span(out.trace, "composite", out.frame);
+            image.composite(rendered_image, Magick::CenterGravity, Magick::OverCompositeOp);
         }
 
-        //render abc
-        renderer.render(ctx, i);
+        TraceSpan span(out.trace, "encode", out.frame);
+        image.depth(8);
+        image.write(out.path);
+    }
 
-        elapsed_seconds = std::chrono::system_clock::now() - start;
-        std::cerr << "  abc rendered in " << elapsed_seconds.count() << " secs \n";
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - out.start;
+    out.log << "image " << out.frame << " completed in " << elapsed_seconds.count() << " secs \n";
 
-        //start = std::chrono::system_clock::now();
+    // frames in flight finish in any order, keep each frame's lines together
+    std::cerr << out.log.str();
+    return 0;
+}
 
-        rendered_image.read(width, height, "RGBA", Magick::FloatPixel, &ctx.data[0]);
-        rendered_image.flip();
+// fingerprints of the frames handed out so far. Every frame takes the
+// entry of the one before it when that was handed out in this process.
+class FrameDedup
+{
+public:
+    struct Entry
+    {
+        bool valid;
+        uint64_t fingerprint;
+        std::string plate;
+        // the rendered image this frame's output has, once written
+        std::string path;
+        std::shared_future<int> written;
+    };
 
-        if (future.valid()) {
-            future.get();
-            image.composite(rendered_image, Magick::CenterGravity, Magick::OverCompositeOp);
-        } else {
-            image = rendered_image;
+    FrameDedup() : reused(0) {}
+
+    // call in frame order, before the frame's previous()
+    void handed_out(int frame)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_handed_out.insert(frame);
+    }
+
+    void add(int frame, const Entry &entry)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_frames[frame] = entry;
+        m_cond.notify_all();
+    }
+
+    // waits until the frame before is added, false when another process
+    // renders it
+    bool previous(int frame, Entry &entry)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_handed_out.count(frame - 1))
+            return false;
+
+        while (!m_frames.count(frame - 1))
+            m_cond.wait(lock);
+
+        entry = m_frames[frame - 1];
+        m_frames.erase(frame - 1);
+        m_handed_out.erase(frame - 1);
+        return true;
+    }
+
+    std::atomic<int> reused;
+
+private:
+    std::set<int> m_handed_out;
+    std::map<int, Entry> m_frames;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+// hard links dest to source, or copies it across file systems
+static bool link_image(const std::string &source, const std::string &dest)
+{
+    if (source == dest)
+        return true;
+
+    unlink(dest.c_str());
+    if (link(source.c_str(), dest.c_str()) == 0)
+        return true;
+
+    std::ifstream in(source.c_str(), std::ios::binary);
+    std::ofstream out(dest.c_str(), std::ios::binary);
+    out << in.rdbuf();
+    return in && out;
+}
+
+// gives out the image of the frame before when its fingerprint and plate
+// are the same. The frame is added to dedup either way, pointing at the
+// image it ends up with.
+static bool reuse_previous(ABCRender &renderer,
+                           FrameDedup &dedup,
+                           FrameOutput &out,
+                           const std::shared_future<int> &written,
+                           const RenderOptions &options)
+{
+    FrameDedup::Entry entry;
+    entry.valid = false;
+    entry.fingerprint = 0;
+    entry.path = out.path;
+    entry.written = written;
+
+    // a failed fingerprint only means the frame is rendered
+    try {
+        if (!options.image_path.empty())
+            format_string(options.image_path, entry.plate, out.frame);
+        entry.fingerprint = renderer.fingerprint(out.frame);
+        entry.valid = true;
+    } catch (std::exception &e) {
+        std::cerr << "error hashing frame " << out.frame << ": " << e.what() << std::endl;
+    }
+
+    FrameDedup::Entry previous;
+    bool reused = false;
+    if (dedup.previous(out.frame, previous) && entry.valid && previous.valid &&
+            entry.fingerprint == previous.fingerprint && entry.plate == previous.plate) {
+        TraceSpan span(out.trace, "reuse", out.frame);
+        // a broken promise means the frame before failed
+        try {
+            reused = previous.written.get() == 0 && link_image(previous.path, out.path);
+        } catch (std::future_error &) {
         }
+    }
 
-        format_string(dest_path, out_image_path, i);
+    if (reused) {
+        entry.path = previous.path;
+        entry.written = previous.written;
+        dedup.reused++;
+        std::cerr << "image " << out.frame << " is the same as " << previous.path << std::endl;
+    }
 
-        image.depth(8);
-        image.write(out_image_path);
+    dedup.add(out.frame, entry);
+    return reused;
+}
+
+// the whole frame range of the options
+class FrameRange : public FrameSource
+{
+public:
+    FrameRange(int start, int end) : m_next(start), m_end(end) {}
+
+    bool next(int &frame)
+    {
+        if (m_next > m_end)
+            return false;
+        frame = m_next++;
+        return true;
+    }
 
-        elapsed_seconds = std::chrono::system_clock::now() - start;
-        std::cerr << "image " << i << " completed in " << elapsed_seconds.count() << " secs \n";
+    void finished(int frame, bool ok, double seconds) {}
+
+private:
+    int m_next;
+    int m_end;
+};
+
+// hands the frames of a FrameSource to the render slots one at a time
+class FrameFeed
+{
+public:
+    FrameFeed(FrameSource *source, FrameDedup *dedup) :
+        count(0),
+        m_source(source),
+        m_dedup(dedup)
+    {}
+
+    bool next(int &frame)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_source->next(frame))
+            return false;
+        if (m_dedup)
+            m_dedup->handed_out(frame);
+        count++;
+        return true;
+    }
 
-        //break;
-        ctx.clear();
+    void finished(int frame, int result, std::chrono::system_clock::time_point start)
+    {
+        std::chrono::duration<double> seconds = std::chrono::system_clock::now() - start;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_source->finished(frame, result == 0, seconds.count());
     }
 
+    FrameDedup *dedup() const {return m_dedup;}
 
-    return 0;
+    int count;
+
+private:
+    FrameSource *m_source;
+    FrameDedup *m_dedup;
+    std::mutex m_mutex;
+};
+
+static void render_frame(ABCRender &renderer,
+                         FrameWriter &writer,
+                         PlatePrefetch *plates,
+                         FrameFeed *feed,
+                         const RenderOptions &options,
+                         int frame)
+{
+    std::shared_ptr<FrameOutput> out(new FrameOutput());
+    out->frame = frame;
+    out->trace = renderer.trace;
+    out->start = std::chrono::system_clock::now();
+    double trace_start = renderer.trace ? renderer.trace->now() : 0;
+    format_string(options.dest_path, out->path, frame);
+
+    // taken even for reused frames, so the read ahead moves on
+    if (plates)
+        out->plate = plates->take(frame);
+
+    std::shared_ptr<std::promise<int> > written(new std::promise<int>());
+    FrameDedup *dedup = feed->dedup();
+    if (dedup && reuse_previous(renderer, *dedup, *out, written->get_future().share(), options)) {
+        written->set_value(0);
+        feed->finished(frame, 0, out->start);
+        return;
+    }
+
+    RenderContext *ctx = writer.acquire();
+    out->ctx = ctx;
+
+    try {
+        //render abc
+        renderer.render(*ctx, frame);
+    } catch (...) {
+        writer.release(ctx);
+        written->set_value(-1);
+        feed->finished(frame, -1, out->start);
+        throw;
+    }
+
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - out->start;
+    out->log << "  abc rendered in " << elapsed_seconds.count() << " secs \n";
+
+    RenderStats stats = ctx->stats();
+    out->log << "  " << renderer.culled_meshes() << " of " << renderer.mesh_list.size()
+             << " meshes outside the camera \n";
+    out->log << "  " << stats.triangles << " triangles, hi-z rejected "
+             << stats.hiz_triangles << " triangles and "
+             << stats.hiz_pixels << " pixels \n";
+
+    if (renderer.trace) {
+        TraceValues triangles;
+        triangles.push_back(std::make_pair("submitted", (double)stats.triangles));
+        triangles.push_back(std::make_pair("backface", (double)stats.backface_triangles));
+        triangles.push_back(std::make_pair("hi-z", (double)stats.hiz_triangles));
+
+        TraceValues pixels;
+        pixels.push_back(std::make_pair("shaded", (double)stats.shaded_pixels));
+        pixels.push_back(std::make_pair("depth rejected", (double)stats.depth_pixels));
+        pixels.push_back(std::make_pair("hi-z", (double)stats.hiz_pixels));
+
+        TraceValues archive;
+        archive.push_back(std::make_pair("bytes read", (double)renderer.bytes_read()));
+
+        renderer.trace->counter("triangles", frame, triangles);
+        renderer.trace->counter("pixels", frame, pixels);
+        renderer.trace->counter("archive", frame, archive);
+
+        // counters of frames in flight share a track, the frame span keeps
+        // its own copy
+        TraceValues values;
+        for (size_t i = 0; i < triangles.size(); i++)
+            values.push_back(std::make_pair(triangles[i].first + " triangles", triangles[i].second));
+        for (size_t i = 0; i < pixels.size(); i++)
+            values.push_back(std::make_pair(pixels[i].first + " pixels", pixels[i].second));
+        values.push_back(archive[0]);
+        renderer.trace->span("frame", frame, trace_start, renderer.trace->now(), std::string(), values);
+    }
+
+    writer.submit(ctx, [out, &options, written, feed]() {
+        int result = -1;
+        try {
+            result = write_frame(*out, options);
+        } catch (std::exception &e) {
+            std::cerr << "error writing frame " << out->frame << ": " << e.what() << std::endl;
+        }
+        written->set_value(result);
+        feed->finished(out->frame, result, out->start);
+        return result;
+    });
+}
+
+static int render_frames(ABCRender &renderer,
+                         const RenderOptions &options,
+                         FrameWriter *writer,
+                         PlatePrefetch *plates,
+                         FrameFeed *feed)
+{
+    int result = 0;
+    int i;
+    while (feed->next(i)) {
+        try {
+            render_frame(renderer, *writer, plates, feed, options, i);
+        } catch (std::exception &e) {
+            std::cerr << "error rendering frame " << i << ": " << e.what() << std::endl;
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+std::shared_ptr<Texture> load_texture(const RenderOptions &options)
+{
+    Magick::Image texture_image(options.texture_path);
+    int tex_width = texture_image.size().width();
+    int tex_height = texture_image.size().height();
+    std::vector<float> texels(tex_width * tex_height * 4);
+    texture_image.flip();
+    texture_image.write(0, 0, tex_width, tex_height, "RGBA",  Magick::FloatPixel, &texels[0]);
+
+    // deep images keep their range in half floats, 8 bits is enough for the rest
+    TextureFormat format = texture_image.depth() > 8 ? TEXTURE_HALF : TEXTURE_RGBA8;
+    if (options.texture_format_set)
+        format = options.texture_format;
+
+    std::shared_ptr<Texture> texture(new Texture(&texels[0], tex_width, tex_height, format));
+    std::cerr << "texture " << tex_width << "x" << tex_height << " uses "
+              << texture->memory_size() / (1024 * 1024) << " MB" << std::endl;
+    return texture;
+}
+
+int abcrender(const std::string &abc_path,
+              const RenderOptions &options,
+              FrameSource *frames)
+{
+    ABCRender renderer(abc_path, options.threads);
+
+    if (renderer.camera_list.empty()) {
+        std::cerr << "no cameras found" << std::endl;
+        return -1;
+    }
+
+    if (renderer.mesh_list.empty()) {
+        std::cerr << "no mesh found" << std::endl;
+        return -1;
+    }
+
+    std::unique_ptr<Trace> trace;
+    if (!options.trace_path.empty())
+        trace.reset(new Trace());
+    renderer.trace = trace.get();
+
+    std::unique_ptr<SampleCache> sample_cache;
+    if (options.cache_mb > 0)
+        sample_cache.reset(new SampleCache((size_t)options.cache_mb * 1024 * 1024));
+    renderer.sample_cache = sample_cache.get();
+
+    // the calling thread takes part in rasterizing too
+    ThreadPool pool(std::max(options.threads - 1, 0));
+
+    std::shared_ptr<Texture> texture;
+    if (!options.texture_path.empty())
+        texture = load_texture(options);
+    const Texture *tex = texture.get();
+
+    std::unique_ptr<PlatePrefetch> plate_prefetch;
+    if (!options.image_path.empty())
+        plate_prefetch.reset(new PlatePrefetch(options, options.prefetch, trace.get()));
+    PlatePrefetch *plates = plate_prefetch.get();
+
+    // one context per render slot plus the frames queued for writing
+    FrameWriter writer(options.write_threads,
+                       options.frames_in_flight + options.write_queue,
+                       options.width, options.height);
+    for (int i = 0; i < writer.size(); i++) {
+        RenderContext *ctx = writer.context(i);
+        ctx->texture = tex;
+        ctx->pool = &pool;
+        ctx->kernel = options.kernel;
+        ctx->lighting = options.lighting;
+        ctx->visibility = options.visibility;
+        ctx->samples = options.samples;
+    }
+
+    std::unique_ptr<FrameDedup> frame_dedup;
+    if (options.dedup)
+        frame_dedup.reset(new FrameDedup());
+    FrameDedup *dedup = frame_dedup.get();
+
+    FrameRange range(options.start_frame, options.end_frame);
+    FrameFeed feed(frames ? frames : &range, dedup);
+
+    // every frame in flight gets its own reader and RenderContext, Alembic
+    // archives can't be shared between threads.
+    std::vector<std::future<int> > slots;
+
+    for (int i = 1; i < options.frames_in_flight; i++) {
+        slots.push_back(std::async(std::launch::async, [&]() {
+            ABCRender slot_renderer(abc_path, options.threads);
+            slot_renderer.trace = trace.get();
+            slot_renderer.sample_cache = sample_cache.get();
+            return render_frames(slot_renderer, options, &writer, plates, &feed);
+        }));
+    }
+
+    int result = render_frames(renderer, options, &writer, plates, &feed);
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].get())
+            result = -1;
+    }
+
+    if (writer.wait())
+        result = -1;
+
+    if (trace && !trace->write(options.trace_path))
+        result = -1;
+
+    if (dedup) {
+        std::cerr << dedup->reused << " of " << feed.count
+                  << " frames reused the image of the frame before" << std::endl;
+    }
+
+    if (sample_cache) {
+        SampleCacheStats stats = sample_cache->stats();
+        std::cerr << "sample cache " << stats.hits << " hits, " << stats.misses << " misses, "
+                  << stats.evictions << " evicted, " << stats.entries << " samples in "
+                  << stats.bytes / (1024 * 1024) << " of " << options.cache_mb << " MB, peak "
+                  << stats.peak_bytes / (1024 * 1024) << " MB" << std::endl;
+    }
+
+    return result;
 }
@@ -1,6 +1,9 @@
 #ifndef ABCRENDER_H
 #define ABCRENDER_H
 #include "rendercontext.h"
+#include "imagewriter.h"
+#include "trace.h"
+#include "samplecache.h"
 #include <Alembic/AbcGeom/All.h>
 #include <Alembic/AbcCoreAbstract/All.h>
 #include <Alembic/AbcCoreHDF5/All.h>
@@ -13,50 +16,243 @@
 #include <glm/gtx/matrix_decompose.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include <atomic>
+#include <stdint.h>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
 using namespace Alembic::AbcGeom;
 namespace AbcF = ::Alembic::AbcCoreFactory;
 
+struct RenderOptions
+{
+    RenderOptions() :
+        start_frame(0),
+        end_frame(0),
+        width(1920),
+        height(1080),
+        threads(1),
+        frames_in_flight(1),
+        kernel(best_raster_kernel()),
+        lighting(false),
+        visibility(false),
+        samples(1),
+        write_threads(1),
+        write_queue(2),
+        prefetch(0),
+        cache_mb(0),
+        dedup(true),
+        workers(0),
+        chunk(4),
+        texture_format(TEXTURE_RGBA8),
+        texture_format_set(false)
+    {}
+
+    std::string dest_path;
+    std::string image_path;
+    std::string texture_path;
+    int start_frame;
+    int end_frame;
+    int width;
+    int height;
+    int threads;
+    int frames_in_flight;
+    RasterKernel kernel;
+    bool lighting;
+    // shade after visibility is known instead of while drawing
+    bool visibility;
+    // depth and coverage samples per pixel, 1 for no anti-aliasing
+    int samples;
+    ImageWriteOptions write_options;
+    int write_threads;
+    // rendered frames allowed to wait for the writer
+    int write_queue;
+    // image plane frames read ahead
+    int prefetch;
+    // budget of the decoded sample cache, 0 for none
+    int cache_mb;
+    // link frames whose scene didn't change to the frame before
+    bool dedup;
+    // processes rendering chunks of frames from a queue, 0 to render here
+    int workers;
+    int chunk;
+    // shared by the workers, a temporary one when empty
+    std::string queue_dir;
+    // picked from the texture's bit depth unless set
+    TextureFormat texture_format;
+    bool texture_format_set;
+    // chrome trace of every frame's stages, empty for none
+    std::string trace_path;
+};
+
+// hands out the frames abcrender() renders. Calls are serialized, but come
+// from any render slot or image writer thread.
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+
+    // false once no frames are left
+    virtual bool next(int &frame) = 0;
+    // ok when the frame was written or reused, seconds since it was handed out
+    virtual void finished(int frame, bool ok, double seconds) = 0;
+};
+
+// reads options.texture_path in options.texture_format, or in a format
+// picked from its bit depth. Magick exceptions are passed on.
+std::shared_ptr<Texture> load_texture(const RenderOptions &options);
+
+// renders every frame of options, or the ones frames hands out
 int abcrender(const std::string &abc_path,
-              const std::string &dest_path,
-              const std::string &image_path,
-              const std::string &texture_path,
-              int start_frame,
-              int end_frame,
-              int width=1920,
-              int height=1080);
+              const RenderOptions &options,
+              FrameSource *frames = NULL);
+
+// seconds spent in each stage of the last render()
+struct RenderTimes
+{
+    RenderTimes() : read(0), transform(0), raster(0) {}
+
+    // culling, sample decoding, uvs and normals
+    double read;
+    double transform;
+    // triangle setup, binning and the final flush
+    double raster;
+};
+
+struct MeshTopology
+{
+    Int32ArraySamplePtr face_indices;
+    Int32ArraySamplePtr face_counts;
+    // three face-vertex indices per triangle
+    std::vector<unsigned int> triangles;
+};
+
+// per mesh samples kept between frames, keyed on the property sample index.
+// They are shared, so other readers can get them from the SampleCache.
+struct MeshCache
+{
+    MeshCache() :
+        positions_index(-1),
+        indices_index(-1),
+        counts_index(-1),
+        uv_index(-1),
+        normal_index(-1),
+        normals_from_positions(false)
+    {}
+
+    // archive path and file stamp and object path, the prefix of the mesh's
+    // sample cache keys
+    std::string object;
+
+    index_t positions_index;
+    P3fArraySamplePtr positions;
+
+    index_t indices_index;
+    index_t counts_index;
+    std::shared_ptr<MeshTopology> topology;
+
+    index_t uv_index;
+    std::shared_ptr<std::vector<glm::vec2> > uvs;
+
+    index_t normal_index;
+    // computed normals have to follow the positions
+    bool normals_from_positions;
+    std::shared_ptr<std::vector<glm::vec3> > normals;
+};
+
+// world matrix of an xform, static chains are only read once
+struct XformNode
+{
+    XformNode() : parent(-1), constant(false), evaluated(false) {}
+
+    IXform xform;
+    int parent;
+    bool constant;
+    bool evaluated;
+    M44d world;
+};
 
 class ABCRender
 {
 public:
-    ABCRender(const std::string &abc_path);
+    // Ogawa archives are opened with streams file handles, so that many
+    // meshes can be read at once
+    ABCRender(const std::string &abc_path, int streams = 1);
+    // takes the HDF5 lock while closing the archive
+    ~ABCRender();
     std::vector<IPolyMesh> mesh_list;
     std::vector<ICamera> camera_list;
     void render(RenderContext &ctx, int frame);
-    void draw_mesh(RenderContext &ctx,
-                   const IPolyMesh &mesh,
-                   double seconds);
+    // hash of the sample indices of everything render() reads, frames with
+    // the same fingerprint give the same image
+    uint64_t fingerprint(int frame);
+    // draws a mesh read by the last read_meshes()
+    void draw_mesh(RenderContext &ctx, size_t index);
 
-    void read_uvs(const IPolyMeshSchema::Sample& m_sample,
-                  const IPolyMeshSchema &m_schema,
+    void read_uvs(const IPolyMeshSchema &m_schema,
+                  const ISampleSelector &sel,
+                  size_t face_indices,
                   std::vector<glm::vec2> &uvs);
 
-    void read_normals(const IPolyMeshSchema::Sample& m_sample,
-                      const IPolyMeshSchema &m_schema,
-                      std::vector<glm::vec3> &normals);
+    // returns false when the mesh has no normals and they were created
+    bool read_normals(const IPolyMeshSchema &m_schema,
+                      const ISampleSelector &sel,
+                      const P3fArraySamplePtr &positions,
+                      const Int32ArraySamplePtr &faceIndices,
+                      const Int32ArraySamplePtr &faceCounts,
+                      std::vector<glm::vec3> &normals,
+                      ThreadPool *pool);
 
-    void create_normals(const IPolyMeshSchema::Sample& m_sample,
-                        const IPolyMeshSchema &m_schema,
-                        std::vector<glm::vec3> &normals);
+    void create_normals(const P3fArraySamplePtr &positions,
+                        const Int32ArraySamplePtr &faceIndices,
+                        const Int32ArraySamplePtr &faceCounts,
+                        std::vector<glm::vec3> &normals,
+                        ThreadPool *pool);
+
+    // meshes skipped by their bounds in the last render()
+    int culled_meshes() const {return m_culled_meshes;}
+    const RenderTimes &times() const {return m_times;}
+    // size of the samples read from the archive in the last render()
+    unsigned long long bytes_read() const {return m_bytes_read;}
+
+    // stages are recorded here when set
+    Trace *trace;
+    // decoded samples are looked up here before reading them, when set
+    SampleCache *sample_cache;
 
 private:
+    void read_object(IObject object, int parent);
+    void update_xforms(double seconds);
+    M44d world_matrix(int xform) const;
+    bool mesh_culled(size_t index, const ISampleSelector &sel) const;
+    void read_meshes(ThreadPool *pool, double seconds);
+    void read_geometry(const IPolyMeshSchema &schema,
+                       const ISampleSelector &sel,
+                       MeshCache &cache,
+                       ThreadPool *pool);
+
     IArchive m_archive;
+    // reads are serialized behind a lock shared by every HDF5 archive
+    bool m_hdf5;
     glm::mat4 m_view_matrix;
     glm::mat4 m_projection_matrix;
     glm::mat4 m_screen_matrix;
+    int m_culled_meshes;
+    RenderTimes m_times;
+    int m_frame;
+    std::atomic<unsigned long long> m_bytes_read;
+    std::vector<MeshCache> m_mesh_cache;
+    // meshes inside the camera this frame, in drawing order
+    std::vector<size_t> m_visible_meshes;
+    std::vector<glm::vec4> m_points;
+    std::vector<unsigned char> m_clip_codes;
+
+    // nearest xform above each mesh and camera, -1 for none
+    std::vector<XformNode> m_xforms;
+    std::vector<int> m_mesh_xform;
+    std::vector<int> m_camera_xform;
 };
 
 #endif // ABCRENDER_H
@@ -0,0 +1,504 @@
+#include "abcrender.h"
+#include "rendercontext.h"
+#include "imagewriter.h"
+#include "threadpool.h"
+
+#include <Alembic/AbcCoreOgawa/All.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// writes synthetic archives, renders them at several sizes and prints the
+// time spent in every stage as json on stdout. Checks the msaa resolve
+// first.
+
+#define BENCH_FPS 24.0
+
+struct Resolution
+{
+    int width;
+    int height;
+};
+
+struct Scene
+{
+    std::string name;
+    std::string path;
+    int meshes;
+};
+
+struct Samples
+{
+    std::vector<double> values;
+    void add(double seconds) {values.push_back(seconds * 1000.0);}
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// grid in the xy plane, faces are clockwise seen from +z like the ones
+// alembic exporters write.
+static void make_grid(int size, float x0, float y0, float extent, float z,
+                      std::vector<V3f> &positions,
+                      std::vector<int32_t> &indices,
+                      std::vector<int32_t> &counts)
+{
+    positions.clear();
+    indices.clear();
+    counts.clear();
+
+    for (int y = 0; y <= size; y++) {
+        for (int x = 0; x <= size; x++) {
+            positions.push_back(V3f(x0 + extent * x / size,
+                                    y0 + extent * y / size,
+                                    z));
+        }
+    }
+
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int a = y * (size + 1) + x;
+            indices.push_back(a);
+            indices.push_back(a + size + 1);
+            indices.push_back(a + size + 2);
+            indices.push_back(a + 1);
+            counts.push_back(4);
+        }
+    }
+}
+
+static void grid_attributes(const std::vector<V3f> &positions,
+                            const std::vector<int32_t> &indices,
+                            float x0, float y0, float extent,
+                            std::vector<V2f> &uvs,
+                            std::vector<N3f> &normals)
+{
+    uvs.clear();
+    normals.clear();
+    for (size_t i = 0; i < indices.size(); i++) {
+        const V3f &p = positions[indices[i]];
+        uvs.push_back(V2f((p.x - x0) / extent, (p.y - y0) / extent));
+        normals.push_back(N3f(0, 0, 1));
+    }
+}
+
+static void write_grid(OObject parent, const std::string &name, uint32_t time_index,
+                       int size, float x0, float y0, float extent, float z,
+                       bool with_uvs, bool with_normals)
+{
+    std::vector<V3f> positions;
+    std::vector<int32_t> indices;
+    std::vector<int32_t> counts;
+    std::vector<V2f> uvs;
+    std::vector<N3f> normals;
+    make_grid(size, x0, y0, extent, z, positions, indices, counts);
+    grid_attributes(positions, indices, x0, y0, extent, uvs, normals);
+
+    OV2fGeomParam::Sample uv_sample;
+    if (with_uvs)
+        uv_sample = OV2fGeomParam::Sample(V2fArraySample(uvs), kFacevaryingScope);
+
+    ON3fGeomParam::Sample normal_sample;
+    if (with_normals)
+        normal_sample = ON3fGeomParam::Sample(N3fArraySample(normals), kFacevaryingScope);
+
+    OPolyMesh mesh(parent, name, time_index);
+    mesh.getSchema().set(OPolyMeshSchema::Sample(P3fArraySample(positions),
+                                                 Int32ArraySample(indices),
+                                                 Int32ArraySample(counts),
+                                                 uv_sample,
+                                                 normal_sample));
+}
+
+static void write_camera(OArchive &archive, uint32_t time_index)
+{
+    OXform xform(archive.getTop(), "camera_xform", time_index);
+    XformSample xform_sample;
+    xform_sample.setTranslation(V3d(0, 0, 3));
+    xform.getSchema().set(xform_sample);
+
+    OCamera camera(xform, "camera", time_index);
+    CameraSample camera_sample;
+    camera_sample.setFocalLength(35);
+    camera.getSchema().set(camera_sample);
+}
+
+// one dense grid filling the frame
+static int write_dense_grid(const std::string &path, int frames)
+{
+    OArchive archive(Alembic::AbcCoreOgawa::WriteArchive(), path);
+    uint32_t time_index = archive.addTimeSampling(TimeSampling(1.0 / BENCH_FPS, 0.0));
+    write_camera(archive, time_index);
+    write_grid(archive.getTop(), "grid", time_index, 512, -1.5f, -1.0f, 3.0f, 0.0f, true, false);
+    return 1;
+}
+
+// lots of small meshes, half of them with normals and uvs
+static int write_small_meshes(const std::string &path, int frames)
+{
+    OArchive archive(Alembic::AbcCoreOgawa::WriteArchive(), path);
+    uint32_t time_index = archive.addTimeSampling(TimeSampling(1.0 / BENCH_FPS, 0.0));
+    write_camera(archive, time_index);
+
+    const int side = 48;
+    const float extent = 3.0f / side;
+    int count = 0;
+    for (int y = 0; y < side; y++) {
+        for (int x = 0; x < side; x++) {
+            char name[64];
+            snprintf(name, sizeof(name), "mesh_%d_%d", x, y);
+            bool attributes = (x + y) % 2 == 0;
+            write_grid(archive.getTop(), name, time_index, 4,
+                       -1.5f + x * extent, -1.0f + y * extent * 2.0f / 3.0f,
+                       extent * 0.9f, 0.0f, attributes, attributes);
+            count++;
+        }
+    }
+    return count;
+}
+
+// a long chain of animated xforms with a small mesh under every one
+static int write_deep_hierarchy(const std::string &path, int frames)
+{
+    OArchive archive(Alembic::AbcCoreOgawa::WriteArchive(), path);
+    uint32_t time_index = archive.addTimeSampling(TimeSampling(1.0 / BENCH_FPS, 0.0));
+    write_camera(archive, time_index);
+
+    const int depth = 128;
+    OObject parent = archive.getTop();
+    for (int i = 0; i < depth; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "xform_%d", i);
+        OXform xform(parent, name, time_index);
+        for (int frame = 0; frame <= frames; frame++) {
+            XformSample sample;
+            sample.setTranslation(V3d(i == 0 ? -1.0 : 0.02, 0.0, 0.0));
+            sample.setZRotation(0.5 + 0.1 * frame);
+            xform.getSchema().set(sample);
+        }
+
+        snprintf(name, sizeof(name), "mesh_%d", i);
+        write_grid(xform, name, time_index, 8, -0.05f, -0.05f, 0.1f, 0.0f, true, true);
+        parent = xform;
+    }
+    return depth;
+}
+
+// constant topology, new positions every frame and no normals or uvs
+static int write_deforming(const std::string &path, int frames)
+{
+    OArchive archive(Alembic::AbcCoreOgawa::WriteArchive(), path);
+    uint32_t time_index = archive.addTimeSampling(TimeSampling(1.0 / BENCH_FPS, 0.0));
+    write_camera(archive, time_index);
+
+    std::vector<V3f> positions;
+    std::vector<int32_t> indices;
+    std::vector<int32_t> counts;
+    make_grid(256, -1.5f, -1.0f, 3.0f, 0.0f, positions, indices, counts);
+
+    OPolyMesh mesh(archive.getTop(), "deforming", time_index);
+    OPolyMeshSchema &schema = mesh.getSchema();
+    for (int frame = 0; frame <= frames; frame++) {
+        std::vector<V3f> moved(positions);
+        for (size_t i = 0; i < moved.size(); i++)
+            moved[i].z = 0.1f * sinf(moved[i].x * 4.0f + frame * 0.3f);
+
+        if (frame == 0)
+            schema.set(OPolyMeshSchema::Sample(P3fArraySample(moved),
+                                               Int32ArraySample(indices),
+                                               Int32ArraySample(counts)));
+        else
+            schema.set(OPolyMeshSchema::Sample(P3fArraySample(moved)));
+    }
+    return 1;
+}
+
+static const char *kernel_name(RasterKernel kernel)
+{
+    switch (kernel) {
+    case RASTER_SSE41:
+        return "sse4";
+    case RASTER_AVX2:
+        return "avx2";
+    default:
+        return "scanline";
+    }
+}
+
+static void write_stats(std::ostream &out, const std::string &name, const Samples &samples)
+{
+    std::vector<double> values(samples.values);
+    std::sort(values.begin(), values.end());
+
+    double median = 0;
+    double mean = 0;
+    double variance = 0;
+    if (!values.empty()) {
+        size_t mid = values.size() / 2;
+        median = values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) * 0.5;
+        for (size_t i = 0; i < values.size(); i++)
+            mean += values[i];
+        mean /= values.size();
+        for (size_t i = 0; i < values.size(); i++)
+            variance += (values[i] - mean) * (values[i] - mean);
+        variance /= values.size();
+    }
+
+    out << "\"" << name << "\": {"
+        << "\"median\": " << median << ", "
+        << "\"min\": " << (values.empty() ? 0 : values.front()) << ", "
+        << "\"max\": " << (values.empty() ? 0 : values.back()) << ", "
+        << "\"stddev\": " << sqrt(variance) << "}";
+}
+
+static void bench_normals(ABCRender &renderer, int frames, ThreadPool *pool, Samples &samples)
+{
+    for (int frame = 0; frame < frames; frame++) {
+        ISampleSelector sel(frame / BENCH_FPS);
+        double seconds = 0;
+        for (size_t i = 0; i < renderer.mesh_list.size(); i++) {
+            IPolyMeshSchema::Sample sample;
+            renderer.mesh_list[i].getSchema().get(sample, sel);
+
+            std::vector<glm::vec3> normals;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            renderer.create_normals(sample.getPositions(),
+                                    sample.getFaceIndices(),
+                                    sample.getFaceCounts(),
+                                    normals,
+                                    pool);
+            seconds += seconds_since(start);
+        }
+        samples.add(seconds);
+    }
+}
+
+static void bench_scene(std::ostream &out, const Scene &scene,
+                        const std::vector<Resolution> &resolutions,
+                        int frames, ThreadPool *pool, RasterKernel kernel,
+                        const std::string &image_path)
+{
+    std::cerr << "bench " << scene.name << std::endl;
+
+    Samples construct;
+    for (int i = 0; i < frames; i++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ABCRender renderer(scene.path);
+        construct.add(seconds_since(start));
+    }
+
+    Samples normals;
+    {
+        ABCRender renderer(scene.path);
+        bench_normals(renderer, frames, pool, normals);
+    }
+
+    out << "    {\"name\": \"" << scene.name << "\", "
+        << "\"meshes\": " << scene.meshes << ",\n      ";
+    write_stats(out, "construct", construct);
+    out << ",\n      ";
+    write_stats(out, "normals", normals);
+    out << ",\n      \"resolutions\": [\n";
+
+    for (size_t r = 0; r < resolutions.size(); r++) {
+        const Resolution &res = resolutions[r];
+        ABCRender renderer(scene.path, pool->size());
+        RenderContext ctx(res.width, res.height);
+        ctx.pool = pool;
+        ctx.kernel = kernel;
+
+        Samples read, transform, raster, output, total;
+        // the first frame fills the mesh cache and is not counted
+        for (int frame = -1; frame < frames; frame++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            ctx.clear();
+            renderer.render(ctx, std::max(frame, 0));
+
+            std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+            write_image(image_path, &ctx.data[0], res.width, res.height, ImageWriteOptions());
+            double write_seconds = seconds_since(write_start);
+
+            if (frame < 0)
+                continue;
+
+            const RenderTimes &times = renderer.times();
+            read.add(times.read);
+            transform.add(times.transform);
+            raster.add(times.raster);
+            output.add(write_seconds);
+            total.add(seconds_since(start));
+        }
+
+        out << "        {\"width\": " << res.width << ", \"height\": " << res.height << ",\n          ";
+        write_stats(out, "read", read);
+        out << ",\n          ";
+        write_stats(out, "transform", transform);
+        out << ",\n          ";
+        write_stats(out, "raster", raster);
+        out << ",\n          ";
+        write_stats(out, "output", output);
+        out << ",\n          ";
+        write_stats(out, "total", total);
+        out << "}" << (r + 1 < resolutions.size() ? "," : "") << "\n";
+    }
+
+    out << "      ]}";
+}
+
+// a flat lit triangle whose left edge runs through the centers of column 1,
+// so those pixels have half their samples covered. They have to come out
+// in the triangle's color with alpha 0.5, not darkened by the coverage.
+static bool check_msaa_resolve()
+{
+    const int samples[] = {4, 8};
+    for (size_t n = 0; n < sizeof(samples) / sizeof(samples[0]); n++) {
+        RenderContext ctx(4, 4);
+        ctx.lighting = true;
+        ctx.samples = samples[n];
+
+        Vertex v[3];
+        v[0].pos = glm::vec4(1, -10, 0.5f, 1);
+        v[1].pos = glm::vec4(1, 20, 0.5f, 1);
+        v[2].pos = glm::vec4(20, -10, 0.5f, 1);
+        for (int i = 0; i < 3; i++)
+            v[i].normal = glm::vec3(0, 0, 0.5f);
+        float shade = light_amount(v[0].normal);
+
+        ctx.draw_triangle(v[0], v[1], v[2]);
+        ctx.resolve();
+
+        glm::vec4 edge = ctx.get_pixel(1, 1);
+        glm::vec4 inside = ctx.get_pixel(2, 1);
+        bool ok = true;
+        for (int i = 0; i < 3; i++) {
+            ok = ok && fabs(edge[i] - shade) < 1e-5f;
+            ok = ok && fabs(inside[i] - shade) < 1e-5f;
+        }
+        ok = ok && fabs(edge.a - 0.5f) < 1e-5f && fabs(inside.a - 1.0f) < 1e-5f;
+
+        if (!ok) {
+            std::cerr << "msaa " << samples[n] << " resolve check failed: edge pixel "
+                      << glm::to_string(edge) << ", inside pixel " << glm::to_string(inside)
+                      << ", expected color " << shade << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void usage_message(const char argv0[])
+{
+    std::cerr << "usage: " << argv0 << " [options]" << std::endl;
+    std::cerr << "          --frames   timed frames per scene and size [default: 10]" << std::endl;
+    std::cerr << "          --threads  rasterizer threads [default: number of cores]" << std::endl;
+    std::cerr << "          --size     rendered size, repeat for more [default: 640x360 1920x1080 3840x2160]" << std::endl;
+    std::cerr << "          --scene    only run grid, small, deep or deforming, repeat for more" << std::endl;
+    std::cerr << "          --dir      directory for the generated archives [default: /tmp]" << std::endl;
+    std::cerr << "          --keep     keep the generated archives." << std::endl;
+    std::cerr << "       -h --help     display this usage information." << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    int frames = 10;
+    int threads = std::thread::hardware_concurrency();
+    std::string dir = "/tmp";
+    bool keep = false;
+    std::vector<Resolution> resolutions;
+    std::vector<std::string> only;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string a(argv[i]);
+        if (a == "--frames" && i+1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (a == "--threads" && i+1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (a == "--size" && i+1 < argc) {
+            Resolution res;
+            if (sscanf(argv[++i], "%dx%d", &res.width, &res.height) != 2 ||
+                    res.width < 1 || res.height < 1) {
+                std::cerr << "error parsing size: \"" << argv[i] << "\"" << std::endl;
+                return -1;
+            }
+            resolutions.push_back(res);
+        } else if (a == "--scene" && i+1 < argc) {
+            only.push_back(argv[++i]);
+        } else if (a == "--dir" && i+1 < argc) {
+            dir = argv[++i];
+        } else if (a == "--keep") {
+            keep = true;
+        } else if (a == "-h" || a == "--help") {
+            usage_message(argv[0]);
+            return 0;
+        } else {
+            usage_message(argv[0]);
+            std::cerr << "invalid option \""<< a << "\"" << std::endl;
+            return -1;
+        }
+    }
+
+    if (frames < 1 || threads < 1) {
+        std::cerr << "frames and threads must be at least 1" << std::endl;
+        return -1;
+    }
+
+    if (resolutions.empty()) {
+        Resolution defaults[] = {{640, 360}, {1920, 1080}, {3840, 2160}};
+        resolutions.assign(defaults, defaults + 3);
+    }
+
+    typedef int (*SceneWriter)(const std::string &, int);
+    struct SceneType {const char *name; SceneWriter write;};
+    SceneType types[] = {
+        {"grid", write_dense_grid},
+        {"small", write_small_meshes},
+        {"deep", write_deep_hierarchy},
+        {"deforming", write_deforming},
+    };
+
+    std::vector<Scene> scenes;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!only.empty() && std::find(only.begin(), only.end(), types[i].name) == only.end())
+            continue;
+
+        Scene scene;
+        scene.name = types[i].name;
+        scene.path = dir + "/abcrender_bench_" + scene.name + ".abc";
+        std::cerr << "writing " << scene.path << std::endl;
+        scene.meshes = types[i].write(scene.path, frames);
+        scenes.push_back(scene);
+    }
+
+    if (!check_msaa_resolve())
+        return -1;
+
+    ThreadPool pool(threads - 1);
+    RasterKernel kernel = best_raster_kernel();
+    std::string image_path = dir + "/abcrender_bench.png";
+
+    std::cout << "{\"threads\": " << threads << ", \"frames\": " << frames
+              << ", \"kernel\": \"" << kernel_name(kernel) << "\", \"unit\": \"ms\",\n"
+              << "  \"scenes\": [\n";
+    for (size_t i = 0; i < scenes.size(); i++) {
+        bench_scene(std::cout, scenes[i], resolutions, frames, &pool, kernel, image_path);
+        std::cout << (i + 1 < scenes.size() ? "," : "") << "\n";
+    }
+    std::cout << "  ]}" << std::endl;
+
+    if (!keep) {
+        for (size_t i = 0; i < scenes.size(); i++)
+            remove(scenes[i].path.c_str());
+        remove(image_path.c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "clip.h"
+
+// signed distances to each plane, negative outside. transform_points
+// computes the same expressions for its clip codes.
+static float plane_distance(const glm::vec4 &pos, int plane, float width, float height)
+{
+    switch (plane) {
+    case 0:
+        return pos.z + pos.w;
+    case 1:
+        return pos.x + GUARD_BAND * pos.w;
+    case 2:
+        return (width + GUARD_BAND) * pos.w - pos.x;
+    case 3:
+        return pos.y + GUARD_BAND * pos.w;
+    default:
+        return (height + GUARD_BAND) * pos.w - pos.y;
+    }
+}
+
+unsigned int clip_code(const glm::vec4 &pos, float width, float height)
+{
+    unsigned int code = 0;
+    for (int plane = 0; plane < CLIP_PLANES; plane++) {
+        if (plane_distance(pos, plane, width, height) < 0)
+            code |= 1 << plane;
+    }
+    return code;
+}
+
+static Vertex lerp_vertex(const Vertex &a, const Vertex &b, float t)
+{
+    Vertex v;
+    v.pos = a.pos + (b.pos - a.pos) * t;
+    v.uv = a.uv + (b.uv - a.uv) * t;
+    v.normal = a.normal + (b.normal - a.normal) * t;
+    return v;
+}
+
+int clip_triangle(const Vertex in[3], float width, float height, Vertex out[CLIP_MAX_VERTICES])
+{
+    Vertex buffer[2][CLIP_MAX_VERTICES];
+    Vertex *src = buffer[0];
+    Vertex *dst = buffer[1];
+    int count = 3;
+    for (int i = 0; i < 3; i++)
+        src[i] = in[i];
+
+    // attributes are linear in homogeneous space, so plain lerps keep
+    // them perspective correct. The near plane goes first, the guard band
+    // tests assume w > 0.
+    for (int plane = 0; plane < CLIP_PLANES && count > 0; plane++) {
+        float dist[CLIP_MAX_VERTICES];
+        bool outside = false;
+        for (int i = 0; i < count; i++) {
+            dist[i] = plane_distance(src[i].pos, plane, width, height);
+            outside |= dist[i] < 0;
+        }
+        if (!outside)
+            continue;
+
+        int clipped = 0;
+        for (int i = 0; i < count; i++) {
+            int j = (i + 1) % count;
+            if (dist[i] >= 0)
+                dst[clipped++] = src[i];
+            if ((dist[i] >= 0) != (dist[j] >= 0))
+                dst[clipped++] = lerp_vertex(src[i], src[j], dist[i] / (dist[i] - dist[j]));
+        }
+
+        Vertex *temp = src;
+        src = dst;
+        dst = temp;
+        count = clipped;
+    }
+
+    for (int i = 0; i < count; i++) {
+        out[i] = src[i];
+        out[i].pos.x /= out[i].pos.w;
+        out[i].pos.y /= out[i].pos.w;
+        out[i].pos.z /= out[i].pos.w;
+    }
+    return count;
+}
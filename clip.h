@@ -0,0 +1,30 @@
+#ifndef CLIP_H
+#define CLIP_H
+
+#include "vertex.h"
+#include <glm/glm.hpp>
+
+// pixels past each edge of the viewport that are rasterized without
+// clipping, the span and tile clamps take care of them.
+#define GUARD_BAND 1024.0f
+
+// set for every plane a homogeneous screen space point is outside of
+#define CLIP_NEAR 1
+#define CLIP_LEFT 2
+#define CLIP_RIGHT 4
+#define CLIP_BOTTOM 8
+#define CLIP_TOP 16
+#define CLIP_PLANES 5
+
+// a triangle clipped by every plane
+#define CLIP_MAX_VERTICES (3 + CLIP_PLANES)
+
+// pos is screen matrix * projection * view * model * point, not divided
+unsigned int clip_code(const glm::vec4 &pos, float width, float height);
+
+// clips a triangle with undivided positions against the near plane and the
+// guard band. out gets the polygon with x, y and z divided by w, the
+// vertex count is returned.
+int clip_triangle(const Vertex in[3], float width, float height, Vertex out[CLIP_MAX_VERTICES]);
+
+#endif // CLIP_H
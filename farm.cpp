@@ -0,0 +1,713 @@
+#include "farm.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// a chunk is claimed this many times before it counts as failed
+#define CHUNK_ATTEMPTS 2
+
+// slowest frames listed in the summary
+#define SLOWEST_FRAMES 5
+
+#define CHUNK_PENDING "pending"
+#define CHUNK_RUNNING "running"
+#define CHUNK_DONE "done"
+#define CHUNK_FAILED "failed"
+
+struct Chunk
+{
+    int start;
+    int end;
+    std::string state;
+    int attempts;
+    // host:pid of the worker rendering it, - for none
+    std::string owner;
+};
+
+// what a queue renders, hosts only join a queue of the same job
+struct QueueJob
+{
+    std::string archive;
+    int start;
+    int end;
+};
+
+struct FrameTime
+{
+    int frame;
+    double seconds;
+    bool ok;
+    std::string owner;
+};
+
+static std::string host_name()
+{
+    char name[256];
+    if (gethostname(name, sizeof(name)) != 0)
+        return "localhost";
+    name[sizeof(name) - 1] = '\0';
+    return name;
+}
+
+static std::string worker_name(pid_t pid)
+{
+    std::ostringstream name;
+    name << host_name() << ":" << pid;
+    return name.str();
+}
+
+static bool read_file(int fd, std::string &data)
+{
+    data.clear();
+    char buffer[4096];
+    for (;;) {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0)
+            return false;
+        if (size == 0)
+            return true;
+        data.append(buffer, size);
+    }
+}
+
+static bool write_file(int fd, const std::string &data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t size = write(fd, data.data() + done, data.size() - done);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0)
+            return false;
+        done += size;
+    }
+    return true;
+}
+
+// the path is last on the header line, it may have spaces in it
+static std::string format_queue(const QueueJob &job, const std::vector<Chunk> &chunks)
+{
+    std::ostringstream data;
+    data << "job " << job.start << " " << job.end << " " << job.archive << "\n";
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const Chunk &chunk = chunks[i];
+        data << chunk.start << " " << chunk.end << " " << chunk.state << " "
+             << chunk.attempts << " " << chunk.owner << "\n";
+    }
+    return data.str();
+}
+
+// the queue file is only read and written with an fcntl lock on it, those
+// work across hosts on nfs too. Closing any descriptor of a file drops the
+// process's locks on it, so every update opens it afresh.
+class QueueFile
+{
+public:
+    QueueFile(const std::string &dir) :
+        m_dir(dir),
+        m_fd(-1)
+    {
+        m_job.start = 0;
+        m_job.end = -1;
+    }
+
+    ~QueueFile() {unlock();}
+
+    bool lock()
+    {
+        std::string path = m_dir + "/queue";
+        m_fd = open(path.c_str(), O_RDWR);
+        if (m_fd < 0) {
+            std::cerr << "error opening queue " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        struct flock lock;
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        while (fcntl(m_fd, F_SETLKW, &lock) != 0) {
+            if (errno != EINTR) {
+                std::cerr << "error locking queue " << path << ": " << strerror(errno) << std::endl;
+                unlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void unlock()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+        m_fd = -1;
+    }
+
+    bool read(std::vector<Chunk> &chunks)
+    {
+        std::string data;
+        if (lseek(m_fd, 0, SEEK_SET) < 0 || !read_file(m_fd, data))
+            return false;
+
+        chunks.clear();
+        std::istringstream lines(data);
+        std::string header;
+        if (!(lines >> header >> m_job.start >> m_job.end) || header != "job") {
+            std::cerr << "error reading queue " << m_dir << "/queue: no job header" << std::endl;
+            return false;
+        }
+        lines.ignore(1);
+        std::getline(lines, m_job.archive);
+
+        Chunk chunk;
+        while (lines >> chunk.start >> chunk.end >> chunk.state >> chunk.attempts >> chunk.owner)
+            chunks.push_back(chunk);
+        return true;
+    }
+
+    // the job of the last read
+    const QueueJob &job() const {return m_job;}
+
+    bool write(const std::vector<Chunk> &chunks)
+    {
+        if (lseek(m_fd, 0, SEEK_SET) < 0 || ftruncate(m_fd, 0) != 0 ||
+                !write_file(m_fd, format_queue(m_job, chunks))) {
+            std::cerr << "error writing queue " << m_dir << "/queue: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // call while locked, the lock keeps lines of different workers apart
+    void append_time(const FrameTime &time)
+    {
+        std::string path = m_dir + "/times";
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0) {
+            std::cerr << "error opening " << path << ": " << strerror(errno) << std::endl;
+            return;
+        }
+
+        std::ostringstream line;
+        line << time.frame << " " << time.seconds << " " << time.ok << " " << time.owner << "\n";
+        if (!write_file(fd, line.str()))
+            std::cerr << "error writing " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+    }
+
+private:
+    std::string m_dir;
+    int m_fd;
+    QueueJob m_job;
+};
+
+// the frames of the chunks a worker claims, one chunk at a time
+class ChunkQueue : public FrameSource
+{
+public:
+    ChunkQueue(const std::string &dir) :
+        m_dir(dir),
+        m_owner(worker_name(getpid())),
+        m_current(-1),
+        m_next(0)
+    {}
+
+    bool next(int &frame)
+    {
+        if (m_current < 0 || m_next > m_claimed[m_current].end) {
+            if (!claim())
+                return false;
+        }
+
+        frame = m_next++;
+        return true;
+    }
+
+    void finished(int frame, bool ok, double seconds)
+    {
+        std::map<int, Claim>::iterator found = m_claimed.begin();
+        while (found != m_claimed.end() &&
+                (frame < found->second.start || frame > found->second.end))
+            found++;
+        if (found == m_claimed.end())
+            return;
+
+        Claim &claim = found->second;
+        claim.remaining--;
+        claim.failed |= !ok;
+
+        QueueFile queue(m_dir);
+        if (!queue.lock())
+            return;
+
+        FrameTime time = {frame, seconds, ok, m_owner};
+        queue.append_time(time);
+
+        if (claim.remaining > 0)
+            return;
+
+        std::vector<Chunk> chunks;
+        if (queue.read(chunks) && found->first < (int)chunks.size()) {
+            Chunk &chunk = chunks[found->first];
+            chunk.owner = "-";
+            if (!claim.failed)
+                chunk.state = CHUNK_DONE;
+            else if (chunk.attempts < CHUNK_ATTEMPTS)
+                chunk.state = CHUNK_PENDING;
+            else
+                chunk.state = CHUNK_FAILED;
+            queue.write(chunks);
+
+            if (claim.failed) {
+                std::cerr << "frames " << chunk.start << "-" << chunk.end << " failed, "
+                          << (chunk.state == CHUNK_PENDING ? "queued again" : "giving up") << std::endl;
+            }
+        }
+
+        if (m_current == found->first)
+            m_current = -1;
+        m_claimed.erase(found);
+    }
+
+private:
+    struct Claim
+    {
+        int start;
+        int end;
+        // frames not finished yet
+        int remaining;
+        bool failed;
+    };
+
+    bool claim()
+    {
+        QueueFile queue(m_dir);
+        std::vector<Chunk> chunks;
+        if (!queue.lock() || !queue.read(chunks))
+            return false;
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            Chunk &chunk = chunks[i];
+            // a retry of a chunk this worker still finishes frames of waits
+            if (chunk.state != CHUNK_PENDING || m_claimed.count(i))
+                continue;
+
+            chunk.state = CHUNK_RUNNING;
+            chunk.attempts++;
+            chunk.owner = m_owner;
+            if (!queue.write(chunks))
+                return false;
+
+            Claim claim = {chunk.start, chunk.end, chunk.end - chunk.start + 1, false};
+            m_claimed[i] = claim;
+            m_current = i;
+            m_next = chunk.start;
+            return true;
+        }
+        return false;
+    }
+
+    std::string m_dir;
+    std::string m_owner;
+    // queue index of the chunks with frames in flight
+    std::map<int, Claim> m_claimed;
+    int m_current;
+    int m_next;
+};
+
+static int run_worker(const std::string &abc_path,
+                      const RenderOptions &farm_options,
+                      const std::string &dir)
+{
+    RenderOptions options = farm_options;
+    // the plate read ahead assumes one run of frames
+    options.prefetch = 0;
+
+    if (!options.trace_path.empty()) {
+        std::ostringstream pid;
+        pid << "." << getpid();
+        size_t ext = options.trace_path.find_last_of(".");
+        size_t name = options.trace_path.find_last_of("/");
+        if (ext == std::string::npos || (name != std::string::npos && ext < name))
+            ext = options.trace_path.size();
+        options.trace_path.insert(ext, pid.str());
+    }
+
+    ChunkQueue queue(dir);
+    int result = -1;
+    try {
+        result = abcrender(abc_path, options, &queue);
+    } catch (std::exception &e) {
+        std::cerr << "worker " << getpid() << " failed: " << e.what() << std::endl;
+    }
+    return result;
+}
+
+static pid_t start_worker(const std::string &abc_path,
+                          const RenderOptions &options,
+                          const std::string &dir)
+{
+    std::cout.flush();
+    std::cerr.flush();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "error starting worker: " << strerror(errno) << std::endl;
+        return pid;
+    }
+
+    if (pid == 0) {
+        int result = run_worker(abc_path, options, dir);
+        std::cout.flush();
+        std::cerr.flush();
+        _exit(result == 0 ? 0 : 1);
+    }
+    return pid;
+}
+
+// queues the chunks a dead worker was rendering again, returns how many
+static int release_chunks(const std::string &dir, pid_t pid)
+{
+    QueueFile queue(dir);
+    std::vector<Chunk> chunks;
+    if (!queue.lock() || !queue.read(chunks))
+        return 0;
+
+    std::string owner = worker_name(pid);
+    int released = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        Chunk &chunk = chunks[i];
+        if (chunk.state != CHUNK_RUNNING || chunk.owner != owner)
+            continue;
+
+        chunk.owner = "-";
+        if (chunk.attempts < CHUNK_ATTEMPTS) {
+            chunk.state = CHUNK_PENDING;
+            released++;
+        } else {
+            chunk.state = CHUNK_FAILED;
+        }
+        std::cerr << "frames " << chunk.start << "-" << chunk.end << " of worker " << pid << " "
+                  << (chunk.state == CHUNK_PENDING ? "queued again" : "failed") << std::endl;
+    }
+
+    queue.write(chunks);
+    return released;
+}
+
+// hosts may run from other directories, the queue keeps the full path
+static QueueJob queue_job(const std::string &abc_path, const RenderOptions &options)
+{
+    QueueJob job;
+    job.archive = abc_path;
+    job.start = options.start_frame;
+    job.end = options.end_frame;
+
+    char *path = realpath(abc_path.c_str(), NULL);
+    if (path) {
+        job.archive = path;
+        free(path);
+    }
+    return job;
+}
+
+// an existing queue is only joined when it renders the same job and has
+// frames left
+static bool join_queue(const std::string &dir, const QueueJob &job)
+{
+    QueueFile queue(dir);
+    std::vector<Chunk> chunks;
+    if (!queue.lock() || !queue.read(chunks))
+        return false;
+
+    const QueueJob &queued = queue.job();
+    if (queued.archive != job.archive || queued.start != job.start || queued.end != job.end) {
+        std::cerr << "error joining the queue in " << dir << ": it renders frames "
+                  << queued.start << "-" << queued.end << " of " << queued.archive << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i].state == CHUNK_PENDING || chunks[i].state == CHUNK_RUNNING)
+            return true;
+    }
+    std::cerr << "error joining the queue in " << dir << ": it is finished, remove it to render again" << std::endl;
+    return false;
+}
+
+// writes the chunks to a file of its own first, so workers joining from
+// other hosts never see a half written queue
+static bool create_queue(const std::string &dir, const QueueJob &job,
+                         const RenderOptions &options, bool &joined)
+{
+    joined = false;
+    std::string path = dir + "/queue";
+    if (access(path.c_str(), F_OK) == 0) {
+        joined = true;
+        return join_queue(dir, job);
+    }
+
+    std::vector<Chunk> chunks;
+    for (int start = options.start_frame; start <= options.end_frame; start += options.chunk) {
+        Chunk chunk = {start, std::min(start + options.chunk - 1, options.end_frame),
+                       CHUNK_PENDING, 0, "-"};
+        chunks.push_back(chunk);
+    }
+
+    std::string temp_path = path + "." + worker_name(getpid());
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "error creating queue " << temp_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool written = write_file(fd, format_queue(job, chunks));
+    close(fd);
+
+    if (written) {
+        std::string times_path = dir + "/times";
+        fd = open(times_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        written = fd >= 0;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    if (!written) {
+        std::cerr << "error creating queue in " << dir << ": " << strerror(errno) << std::endl;
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    // another host got there first
+    if (link(temp_path.c_str(), path.c_str()) != 0) {
+        if (errno != EEXIST) {
+            std::cerr << "error creating queue " << path << ": " << strerror(errno) << std::endl;
+            unlink(temp_path.c_str());
+            return false;
+        }
+        joined = true;
+    }
+    unlink(temp_path.c_str());
+    return !joined || join_queue(dir, job);
+}
+
+static bool has_pending(const std::string &dir)
+{
+    QueueFile queue(dir);
+    std::vector<Chunk> chunks;
+    if (!queue.lock() || !queue.read(chunks))
+        return false;
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i].state == CHUNK_PENDING)
+            return true;
+    }
+    return false;
+}
+
+// true when the worker finished any frame, good or not
+static bool rendered_frames(const std::string &dir, pid_t pid)
+{
+    QueueFile queue(dir);
+    std::string data;
+    if (!queue.lock())
+        return false;
+
+    std::string path = dir + "/times";
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    read_file(fd, data);
+    close(fd);
+
+    std::string owner = worker_name(pid);
+    std::istringstream lines(data);
+    FrameTime time;
+    while (lines >> time.frame >> time.seconds >> time.ok >> time.owner) {
+        if (time.owner == owner)
+            return true;
+    }
+    return false;
+}
+
+static void print_summary(const std::string &dir)
+{
+    QueueFile queue(dir);
+    std::vector<Chunk> chunks;
+    std::string data;
+    if (queue.lock() && queue.read(chunks)) {
+        std::string path = dir + "/times";
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            read_file(fd, data);
+            close(fd);
+        }
+    }
+    queue.unlock();
+
+    // a frame's last good time counts, retries leave earlier lines behind
+    std::map<int, FrameTime> frames;
+    std::istringstream lines(data);
+    FrameTime time;
+    while (lines >> time.frame >> time.seconds >> time.ok >> time.owner) {
+        std::map<int, FrameTime>::iterator found = frames.find(time.frame);
+        if (found == frames.end() || time.ok || !found->second.ok)
+            frames[time.frame] = time;
+    }
+
+    int failed = 0;
+    int pending = 0;
+    int unfinished = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        int count = chunks[i].end - chunks[i].start + 1;
+        if (chunks[i].state == CHUNK_FAILED) {
+            failed += count;
+            for (int frame = chunks[i].start; frame <= chunks[i].end; frame++)
+                frames.erase(frame);
+        } else if (chunks[i].state == CHUNK_PENDING) {
+            pending += count;
+        } else if (chunks[i].state != CHUNK_DONE) {
+            unfinished += count;
+        }
+    }
+
+    std::vector<FrameTime> done;
+    std::map<std::string, std::pair<int, double> > workers;
+    for (std::map<int, FrameTime>::iterator i = frames.begin(); i != frames.end(); i++) {
+        if (!i->second.ok)
+            continue;
+        done.push_back(i->second);
+        std::pair<int, double> &worker = workers[i->second.owner];
+        worker.first++;
+        worker.second += i->second.seconds;
+    }
+
+    std::cerr << done.size() << " frames rendered, " << failed << " failed";
+    if (pending)
+        std::cerr << ", " << pending << " never rendered";
+    if (unfinished)
+        std::cerr << ", " << unfinished << " left to workers on other hosts";
+    std::cerr << std::endl;
+
+    if (done.empty())
+        return;
+
+    std::sort(done.begin(), done.end(), [](const FrameTime &a, const FrameTime &b) {
+        return a.seconds > b.seconds;
+    });
+
+    double total = 0;
+    for (size_t i = 0; i < done.size(); i++)
+        total += done[i].seconds;
+
+    std::cerr << "  secs per frame min " << done.back().seconds
+              << " median " << done[done.size() / 2].seconds
+              << " mean " << total / done.size()
+              << " max " << done.front().seconds << "\n";
+
+    std::cerr << "  slowest frames";
+    for (size_t i = 0; i < done.size() && i < SLOWEST_FRAMES; i++)
+        std::cerr << " " << done[i].frame << " (" << done[i].seconds << " secs)";
+    std::cerr << "\n";
+
+    for (std::map<std::string, std::pair<int, double> >::iterator i = workers.begin();
+            i != workers.end(); i++) {
+        std::cerr << "  worker " << i->first << " rendered " << i->second.first << " frames in "
+                  << i->second.second << " secs" << "\n";
+    }
+    std::cerr.flush();
+}
+
+int render_farm(const std::string &abc_path,
+                const RenderOptions &options)
+{
+    std::string dir = options.queue_dir;
+    bool temp_dir = dir.empty();
+    if (temp_dir) {
+        char temp[] = "/tmp/abcrender.XXXXXX";
+        if (!mkdtemp(temp)) {
+            std::cerr << "error creating queue directory: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        dir = temp;
+    }
+
+    bool joined;
+    if (!create_queue(dir, queue_job(abc_path, options), options, joined))
+        return -1;
+    if (joined)
+        std::cerr << "joining the queue in " << dir << std::endl;
+
+    std::map<pid_t, int> workers;
+    for (int i = 0; i < options.workers; i++) {
+        pid_t pid = start_worker(abc_path, options, dir);
+        if (pid > 0)
+            workers[pid] = i;
+    }
+
+    int result = workers.empty() ? -1 : 0;
+    while (!workers.empty()) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0 && errno == EINTR)
+            continue;
+        if (pid < 0)
+            break;
+        if (!workers.count(pid))
+            continue;
+
+        int index = workers[pid];
+        workers.erase(pid);
+
+        if (WIFSIGNALED(status))
+            std::cerr << "worker " << pid << " killed by signal " << WTERMSIG(status) << std::endl;
+
+        // frames of a worker that died with its chunks go to a new one. A
+        // failed chunk is only queued again once its last frame is written,
+        // often after its worker ran out of chunks and exited, so any worker
+        // that got frames done is replaced while chunks are pending. One
+        // that failed before rendering anything would fail again.
+        int released = release_chunks(dir, pid);
+        if ((released || rendered_frames(dir, pid)) && has_pending(dir)) {
+            pid_t replacement = start_worker(abc_path, options, dir);
+            if (replacement > 0)
+                workers[replacement] = index;
+        }
+    }
+
+    print_summary(dir);
+
+    QueueFile queue(dir);
+    std::vector<Chunk> chunks;
+    if (queue.lock() && queue.read(chunks)) {
+        // pending chunks are left when no worker could take them
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (chunks[i].state == CHUNK_FAILED || chunks[i].state == CHUNK_PENDING)
+                result = -1;
+        }
+    } else {
+        result = -1;
+    }
+    queue.unlock();
+
+    if (temp_dir) {
+        unlink((dir + "/queue").c_str());
+        unlink((dir + "/times").c_str());
+        rmdir(dir.c_str());
+    }
+
+    return result;
+}
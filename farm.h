@@ -0,0 +1,17 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include "abcrender.h"
+
+#include <string>
+
+// forks options.workers processes that each render chunks of
+// options.chunk frames from a queue file in options.queue_dir. A chunk that
+// fails, or whose worker dies, is queued once more, chunks nobody rendered
+// fail the run. Other hosts can join with the same queue_dir on a shared
+// filesystem. Prints a summary of the frame times of every worker when the
+// queue is done.
+int render_farm(const std::string &abc_path,
+                const RenderOptions &options);
+
+#endif // FARM_H
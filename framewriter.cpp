@@ -0,0 +1,67 @@
+#include "framewriter.h"
+
+FrameWriter::FrameWriter(int threads, int contexts, int width, int height) :
+    m_pending(0),
+    m_result(0),
+    m_pool(threads)
+{
+    for (int i = 0; i < contexts; i++) {
+        m_contexts.push_back(new RenderContext(width, height));
+        m_free.push_back(m_contexts.back());
+    }
+}
+
+FrameWriter::~FrameWriter()
+{
+    wait();
+    for (size_t i = 0; i < m_contexts.size(); i++)
+        delete m_contexts[i];
+}
+
+RenderContext *FrameWriter::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_free.empty())
+        m_cond.wait(lock);
+
+    RenderContext *ctx = m_free.back();
+    m_free.pop_back();
+    return ctx;
+}
+
+void FrameWriter::release(RenderContext *ctx)
+{
+    ctx->clear();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_free.push_back(ctx);
+    m_cond.notify_all();
+}
+
+void FrameWriter::submit(RenderContext *ctx, const std::function<int()> &job)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_pending++;
+    }
+
+    m_pool.run([this, ctx, job]() {
+        int result = job();
+        ctx->clear();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (result)
+            m_result = -1;
+        m_free.push_back(ctx);
+        m_pending--;
+        m_cond.notify_all();
+    });
+}
+
+int FrameWriter::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_pending)
+        m_cond.wait(lock);
+    return m_result;
+}
@@ -0,0 +1,46 @@
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include "rendercontext.h"
+#include "threadpool.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// runs the image writes on their own threads. Renderers take a context,
+// hand it over with its write job and carry on with the next free one,
+// so the number of contexts caps how many frames wait to be written.
+class FrameWriter
+{
+public:
+    FrameWriter(int threads, int contexts, int width, int height);
+    ~FrameWriter();
+
+    int size() const {return (int)m_contexts.size();}
+    RenderContext *context(int index) {return m_contexts[index];}
+
+    // blocks until a context is free
+    RenderContext *acquire();
+    // clears ctx and makes it available again
+    void release(RenderContext *ctx);
+
+    // job returns non zero on failure, ctx is released once it finished
+    void submit(RenderContext *ctx, const std::function<int()> &job);
+
+    // waits for every submitted job, -1 if any of them failed
+    int wait();
+
+private:
+    std::vector<RenderContext*> m_contexts;
+    std::vector<RenderContext*> m_free;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    int m_pending;
+    int m_result;
+    // last, so its threads finish before the rest goes away
+    ThreadPool m_pool;
+};
+
+#endif // FRAMEWRITER_H
@@ -0,0 +1,814 @@
+#include "halfspace.h"
+#include "rendercontext.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+RasterKernel best_raster_kernel()
+{
+    if (raster_kernel_supported(RASTER_AVX2))
+        return RASTER_AVX2;
+    if (raster_kernel_supported(RASTER_SSE41))
+        return RASTER_SSE41;
+    return RASTER_SCANLINE;
+}
+
+bool raster_kernel_supported(RasterKernel kernel)
+{
+    switch (kernel) {
+    case RASTER_SCANLINE:
+        return true;
+#ifdef HAVE_X86_SIMD
+    case RASTER_SSE41:
+        return __builtin_cpu_supports("sse4.1");
+    case RASTER_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+static int clamp_coord(float value, int lo, int hi)
+{
+    // also catches NaN from vertices with w == 0
+    if (!(value > lo))
+        return lo;
+    if (value > hi)
+        return hi;
+    return (int)value;
+}
+
+static Plane edge_plane(const glm::vec4 &p, const glm::vec4 &q, float ox, float oy)
+{
+    // (q - p) x (pixel - p), positive on the inside of a counter clockwise triangle
+    Plane e;
+    e.a = -(q.y - p.y);
+    e.b = q.x - p.x;
+    e.c = -(q.x - p.x) * (p.y - oy) + (q.y - p.y) * (p.x - ox);
+    return e;
+}
+
+static Plane attribute_plane(float a0, float a1, float a2,
+                             float dx1, float dy1,
+                             float dx2, float dy2,
+                             float inv_area)
+{
+    Plane p;
+    p.a = ((a1 - a0) * dy2 - (a2 - a0) * dy1) * inv_area;
+    p.b = ((a2 - a0) * dx1 - (a1 - a0) * dx2) * inv_area;
+    p.c = a0;
+    return p;
+}
+
+HalfSpace::HalfSpace(const Vertex &v0,
+                     const Vertex &v1,
+                     const Vertex &v2,
+                     int xmin, int ymin,
+                     int xmax, int ymax,
+                     float pad)
+{
+    const Vertex *a = &v0;
+    const Vertex *b = &v1;
+    const Vertex *c = &v2;
+
+    x0 = y0 = x1 = y1 = 0;
+
+    float area = (b->pos.x - a->pos.x) * (c->pos.y - a->pos.y) -
+                 (c->pos.x - a->pos.x) * (b->pos.y - a->pos.y);
+
+    if (area < 0) {
+        const Vertex *temp = b;
+        b = c;
+        c = temp;
+        area = -area;
+    }
+
+    if (!(area > 0))
+        return;
+
+    ox = a->pos.x;
+    oy = a->pos.y;
+
+    edge[0] = edge_plane(a->pos, b->pos, ox, oy);
+    edge[1] = edge_plane(b->pos, c->pos, ox, oy);
+    edge[2] = edge_plane(c->pos, a->pos, ox, oy);
+
+    // pixels exactly on an edge belong to left and top edges, the same
+    // ownership the scanline rasterizer's ceil() rule gives.
+    for (int i = 0; i < 3; i++) {
+        top_left[i] = edge[i].a > 0 || (edge[i].a == 0 && edge[i].b > 0);
+    }
+
+    float dx1 = b->pos.x - a->pos.x;
+    float dy1 = b->pos.y - a->pos.y;
+    float dx2 = c->pos.x - a->pos.x;
+    float dy2 = c->pos.y - a->pos.y;
+    float inv_area = 1.0f / area;
+
+    depth = attribute_plane(a->pos.z, b->pos.z, c->pos.z,
+                            dx1, dy1, dx2, dy2, inv_area);
+
+    float w[3] = {1.0f / a->pos.w, 1.0f / b->pos.w, 1.0f / c->pos.w};
+    one_over_z = attribute_plane(w[0], w[1], w[2],
+                                 dx1, dy1, dx2, dy2, inv_area);
+    u = attribute_plane(a->uv.x * w[0], b->uv.x * w[1], c->uv.x * w[2],
+                        dx1, dy1, dx2, dy2, inv_area);
+    v = attribute_plane(a->uv.y * w[0], b->uv.y * w[1], c->uv.y * w[2],
+                        dx1, dy1, dx2, dy2, inv_area);
+    for (int i = 0; i < 3; i++) {
+        normal[i] = attribute_plane(a->normal[i], b->normal[i], c->normal[i],
+                                    dx1, dy1, dx2, dy2, inv_area);
+    }
+
+    float fxmin = std::min(a->pos.x, std::min(b->pos.x, c->pos.x));
+    float fxmax = std::max(a->pos.x, std::max(b->pos.x, c->pos.x));
+    float fymin = std::min(a->pos.y, std::min(b->pos.y, c->pos.y));
+    float fymax = std::max(a->pos.y, std::max(b->pos.y, c->pos.y));
+
+    x0 = clamp_coord(ceil(fxmin - pad), xmin, xmax);
+    x1 = clamp_coord(floor(fxmax + pad) + 1, xmin, xmax);
+    y0 = clamp_coord(ceil(fymin - pad), ymin, ymax);
+    y1 = clamp_coord(floor(fymax + pad) + 1, ymin, ymax);
+}
+
+// pixel range that can be inside the triangle anywhere between rows dy0 and
+// dy1, only a conservative bound, the per pixel edge tests decide coverage.
+static inline bool band_span(const HalfSpace &hs, float dy0, float dy1, int &xstart, int &xend)
+{
+    float left = (float)hs.x0;
+    float right = (float)hs.x1;
+
+    // each edge's crossing moves linearly with y, so the loosest of the
+    // two ends bounds the whole band
+    for (int i = 0; i < 3; i++) {
+        float row0 = hs.edge[i].b * dy0 + hs.edge[i].c;
+        float row1 = hs.edge[i].b * dy1 + hs.edge[i].c;
+        if (hs.edge[i].a > 0) {
+            left = std::max(left, std::min(hs.ox - row0 / hs.edge[i].a,
+                                           hs.ox - row1 / hs.edge[i].a));
+        } else if (hs.edge[i].a < 0) {
+            right = std::min(right, std::max(hs.ox - row0 / hs.edge[i].a,
+                                             hs.ox - row1 / hs.edge[i].a));
+        } else if (row0 < 0 && row1 < 0) {
+            return false;
+        }
+    }
+
+    xstart = clamp_coord(floor(left) - 1, hs.x0, hs.x1);
+    xend = clamp_coord(ceil(right) + 1, hs.x0, hs.x1);
+    return xstart < xend;
+}
+
+static inline bool row_span(const HalfSpace &hs, float dy, int &xstart, int &xend)
+{
+    return band_span(hs, dy, dy, xstart, xend);
+}
+
+static inline void fill_pixel(const RasterTarget &target, int index, float light)
+{
+    float *p = &target.data[index * 4];
+    p[0] = light;
+    p[1] = light;
+    p[2] = light;
+    p[3] = 1;
+}
+
+struct Fragment
+{
+    int index;
+    float u;
+    float v;
+    float z;
+    float light;
+};
+
+#define MAX_FRAGMENTS 64
+
+template <class Shading>
+static inline glm::vec4 shade_fragment(const HalfSpace &hs, const Texture *texture, const Fragment &f)
+{
+    // d(u/z)/dx is the plane's slope, the quotient rule gives du/dx
+    float dudx = (hs.u.a - f.u * hs.one_over_z.a) * f.z;
+    float dvdx = (hs.v.a - f.v * hs.one_over_z.a) * f.z;
+    float dudy = (hs.u.b - f.u * hs.one_over_z.b) * f.z;
+    float dvdy = (hs.v.b - f.v * hs.one_over_z.b) * f.z;
+    float lod = texture->lod(dudx, dvdx, dudy, dvdy);
+
+    glm::vec4 c = texture->sample(f.u, f.v, lod);
+    if (Shading::lit) {
+        for (int k = 0; k < 3; k++)
+            c[k] = c[k] * f.light;
+    }
+    return c;
+}
+
+// textured pixels are shaded in batches outside the vector loop, calling
+// into non-AVX code with live ymm registers is very slow.
+template <class Shading>
+static void shade_fragments(const HalfSpace &hs, const RasterTarget &target, const Fragment *frags, int count)
+{
+    for (int i = 0; i < count; i++) {
+        glm::vec4 c = shade_fragment<Shading>(hs, target.texture, frags[i]);
+        float *p = &target.data[frags[i].index * 4];
+        p[0] = c.r;
+        p[1] = c.g;
+        p[2] = c.b;
+        p[3] = c.a;
+    }
+}
+
+// same arithmetic as the kernels' vector code, one pixel at a time
+template <class Shading>
+static void resolve_rows(const HalfSpace *triangles, const RasterTarget &target,
+                         int width, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < width; x++) {
+            int index = x + y * target.stride;
+            unsigned int id = target.ids[index];
+            if (id == NO_TRIANGLE)
+                continue;
+
+            // too thin for the plane setup, the kernels never cover these
+            const HalfSpace &hs = triangles[id];
+            if (hs.empty())
+                continue;
+
+            float dx = (float)x - hs.ox;
+            float dy = (float)y - hs.oy;
+
+            float light = 1;
+            if (Shading::lit) {
+                float nz = hs.normal[2].a * dx + hs.normal[2].b * dy + hs.normal[2].c;
+                light = std::fabs(nz) * 0.9f + 0.1f;
+            }
+
+            if (!Shading::textured) {
+                fill_pixel(target, index, light);
+                continue;
+            }
+
+            float w = hs.one_over_z.a * dx + hs.one_over_z.b * dy + hs.one_over_z.c;
+            float uw = hs.u.a * dx + hs.u.b * dy + hs.u.c;
+            float vw = hs.v.a * dx + hs.v.b * dy + hs.v.c;
+            float z = 1.0f / w;
+            Fragment frag = {index, uw * z, vw * z, z, light};
+            shade_fragments<Shading>(hs, target, &frag, 1);
+        }
+    }
+}
+
+void resolve_visibility(const HalfSpace *triangles, const RasterTarget &target,
+                        int width, int y0, int y1)
+{
+    switch (target.shading) {
+    case SHADE_TEXTURED:
+        resolve_rows<TexturedShading>(triangles, target, width, y0, y1);
+        break;
+    case SHADE_LIT:
+        resolve_rows<LitShading>(triangles, target, width, y0, y1);
+        break;
+    case SHADE_TEXTURED_LIT:
+        resolve_rows<TexturedLitShading>(triangles, target, width, y0, y1);
+        break;
+    default:
+        resolve_rows<FlatShading>(triangles, target, width, y0, y1);
+        break;
+    }
+}
+
+// sample offsets from the pixel center in 1/16 pixels, the usual 4x and 8x
+// patterns. No two samples share a row or column.
+static const int msaa_4x[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const int msaa_8x[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5},
+                                  {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+template <class Shading>
+static glm::vec4 shade_point(const HalfSpace &hs, const Texture *texture, float dx, float dy)
+{
+    float light = 1;
+    if (Shading::lit) {
+        float nz = hs.normal[2].a * dx + hs.normal[2].b * dy + hs.normal[2].c;
+        light = std::fabs(nz) * 0.9f + 0.1f;
+    }
+
+    if (!Shading::textured)
+        return glm::vec4(light, light, light, 1);
+
+    float w = hs.one_over_z.a * dx + hs.one_over_z.b * dy + hs.one_over_z.c;
+    float uw = hs.u.a * dx + hs.u.b * dy + hs.u.c;
+    float vw = hs.v.a * dx + hs.v.b * dy + hs.v.c;
+    float z = 1.0f / w;
+    Fragment frag = {0, uw * z, vw * z, z, light};
+    return shade_fragment<Shading>(hs, texture, frag);
+}
+
+template <class Shading>
+static void raster_msaa(const HalfSpace &hs, const RasterTarget &target)
+{
+    const int samples = target.samples;
+    const int (*pattern)[2] = samples == 8 ? msaa_8x : msaa_4x;
+    float sx[MAX_SAMPLES];
+    float sy[MAX_SAMPLES];
+    for (int s = 0; s < samples; s++) {
+        sx[s] = pattern[s][0] / 16.0f;
+        sy[s] = pattern[s][1] / 16.0f;
+    }
+
+    // how far a plane can move between the center and any sample of the
+    // pixel, with a margin for rounding
+    float depth_slack = 0.5f * (std::fabs(hs.depth.a) + std::fabs(hs.depth.b));
+    float edge_slack[3];
+    for (int i = 0; i < 3; i++)
+        edge_slack[i] = 0.5f * (std::fabs(hs.edge[i].a) + std::fabs(hs.edge[i].b));
+    unsigned int all = (1u << samples) - 1;
+
+    unsigned long long shaded = 0;
+    unsigned long long rejected = 0;
+
+    for (int y = hs.y0; y < hs.y1; y++) {
+        float dy = (float)y - hs.oy;
+        int xstart, xend;
+        if (!band_span(hs, dy - 0.5f, dy + 0.5f, xstart, xend))
+            continue;
+
+        for (int x = xstart; x < xend; x++) {
+            float dx = (float)x - hs.ox;
+
+            if (target.hiz) {
+                float center = hs.depth.a * dx + hs.depth.b * dy + hs.depth.c;
+                float zmax = target.hiz[x / HIZ_BLOCK + (y / HIZ_BLOCK) * target.hiz_stride];
+                if (center - depth_slack > zmax + HIZ_EPSILON) {
+                    target.stats->hiz_pixels++;
+                    continue;
+                }
+            }
+
+            // most pixels are well inside or outside an edge, only the ones
+            // an edge passes through need the per sample tests
+            bool outside = false;
+            bool interior = true;
+            for (int i = 0; i < 3; i++) {
+                float e = hs.edge[i].a * dx + hs.edge[i].b * dy + hs.edge[i].c;
+                outside = outside || e + edge_slack[i] < 0;
+                interior = interior && e - edge_slack[i] > 0;
+            }
+            if (outside)
+                continue;
+
+            int index = x + y * target.stride;
+            float *depth = &target.depth[index * samples];
+            float z[MAX_SAMPLES];
+            unsigned int covered = 0;
+            unsigned int passed = 0;
+
+            for (int s = 0; s < samples; s++) {
+                float px = dx + sx[s];
+                float py = dy + sy[s];
+                bool inside = true;
+                for (int i = 0; i < 3 && !interior; i++) {
+                    float e = hs.edge[i].a * px + hs.edge[i].b * py + hs.edge[i].c;
+                    inside = inside && (e > 0 || (e == 0 && hs.top_left[i]));
+                }
+                if (!inside)
+                    continue;
+
+                covered |= 1u << s;
+                z[s] = hs.depth.a * px + hs.depth.b * py + hs.depth.c;
+                if (z[s] <= depth[s])
+                    passed |= 1u << s;
+            }
+
+            if (!passed) {
+                if (covered)
+                    rejected++;
+                continue;
+            }
+
+            // the center can be outside a partly covered pixel, where the
+            // perspective divide of extrapolated attributes blows up, so those
+            // are shaded at their first covered sample instead.
+            glm::vec4 c;
+            if (covered == all) {
+                c = shade_point<Shading>(hs, target.texture, dx, dy);
+            } else {
+                int s = 0;
+                while (!(covered & (1u << s)))
+                    s++;
+                c = shade_point<Shading>(hs, target.texture, dx + sx[s], dy + sy[s]);
+            }
+            shaded++;
+
+            float *color = &target.data[index * samples * 4];
+            for (int s = 0; s < samples; s++) {
+                if (!(passed & (1u << s)))
+                    continue;
+                depth[s] = z[s];
+                color[s * 4    ] = c.r;
+                color[s * 4 + 1] = c.g;
+                color[s * 4 + 2] = c.b;
+                color[s * 4 + 3] = c.a;
+            }
+        }
+    }
+
+    target.stats->shaded_pixels += shaded;
+    target.stats->depth_pixels += rejected;
+}
+
+void raster_halfspace_msaa(const HalfSpace &hs, const RasterTarget &target)
+{
+    switch (target.shading) {
+    case SHADE_TEXTURED:
+        raster_msaa<TexturedShading>(hs, target);
+        break;
+    case SHADE_LIT:
+        raster_msaa<LitShading>(hs, target);
+        break;
+    case SHADE_TEXTURED_LIT:
+        raster_msaa<TexturedLitShading>(hs, target);
+        break;
+    default:
+        raster_msaa<FlatShading>(hs, target);
+        break;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+template <class Shading>
+__attribute__((target("sse4.1")))
+static void raster_sse41(const HalfSpace &hs, const RasterTarget &target)
+{
+    const __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 xmin = _mm_set1_ps((float)hs.x0);
+    const __m128 xmax = _mm_set1_ps((float)hs.x1);
+
+    Fragment frags[MAX_FRAGMENTS];
+    int count = 0;
+    unsigned long long shaded = 0;
+    unsigned long long rejected = 0;
+
+    __m128 edge_a[3];
+    __m128 top_left[3];
+    for (int i = 0; i < 3; i++) {
+        edge_a[i] = _mm_set1_ps(hs.edge[i].a);
+        top_left[i] = _mm_castsi128_ps(_mm_set1_epi32(hs.top_left[i] ? -1 : 0));
+    }
+
+    for (int y = hs.y0; y < hs.y1; y++) {
+        float dy = (float)y - hs.oy;
+        int xstart, xend;
+        if (!row_span(hs, dy, xstart, xend))
+            continue;
+
+        // tiles start on multiples of 64, so aligning down stays inside the tile
+        int xfirst = xstart & ~3;
+
+        __m128 edge_row[3];
+        for (int i = 0; i < 3; i++)
+            edge_row[i] = _mm_set1_ps(hs.edge[i].b * dy + hs.edge[i].c);
+        float row_depth = hs.depth.b * dy + hs.depth.c;
+        __m128 depth_row = _mm_set1_ps(row_depth);
+
+        for (int x = xfirst; x < xend; x += 4) {
+            // depth is linear along the row, so the chunk's ends bound it
+            if (target.hiz) {
+                float first = hs.depth.a * ((float)x - hs.ox) + row_depth;
+                float last = hs.depth.a * ((float)(x + 3) - hs.ox) + row_depth;
+                float zmax = target.hiz[x / HIZ_BLOCK + (y / HIZ_BLOCK) * target.hiz_stride];
+                if (std::min(first, last) > zmax + HIZ_EPSILON) {
+                    target.stats->hiz_pixels += std::min(x + 4, xend) - std::max(x, xstart);
+                    continue;
+                }
+            }
+
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane);
+            __m128 dx = _mm_sub_ps(px, _mm_set1_ps(hs.ox));
+
+            __m128 mask = _mm_and_ps(_mm_cmpge_ps(px, xmin), _mm_cmplt_ps(px, xmax));
+            for (int i = 0; i < 3; i++) {
+                __m128 e = _mm_add_ps(_mm_mul_ps(edge_a[i], dx), edge_row[i]);
+                __m128 inside = _mm_or_ps(_mm_cmpgt_ps(e, zero),
+                                          _mm_and_ps(_mm_cmpeq_ps(e, zero), top_left[i]));
+                mask = _mm_and_ps(mask, inside);
+            }
+
+            int covered = _mm_movemask_ps(mask);
+            if (!covered)
+                continue;
+
+            int index = x + y * target.stride;
+            bool full = x + 4 <= hs.x1;
+
+            __m128 stored;
+            if (full) {
+                stored = _mm_loadu_ps(&target.depth[index]);
+            } else {
+                float temp[4] = {FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX};
+                for (int i = 0; x + i < hs.x1; i++)
+                    temp[i] = target.depth[index + i];
+                stored = _mm_loadu_ps(temp);
+            }
+
+            __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(hs.depth.a), dx), depth_row);
+            mask = _mm_and_ps(mask, _mm_cmple_ps(depth, stored));
+
+            int bits = _mm_movemask_ps(mask);
+            shaded += __builtin_popcount(bits);
+            rejected += __builtin_popcount(covered & ~bits);
+            if (!bits)
+                continue;
+
+            if (full) {
+                _mm_storeu_ps(&target.depth[index], _mm_blendv_ps(stored, depth, mask));
+            } else {
+                float temp[4];
+                _mm_storeu_ps(temp, depth);
+                for (int i = 0; i < 4; i++) {
+                    if (bits & (1 << i))
+                        target.depth[index + i] = temp[i];
+                }
+            }
+
+            if (Shading::visibility) {
+                for (int i = 0; i < 4; i++) {
+                    if (bits & (1 << i))
+                        target.ids[index + i] = target.id;
+                }
+                continue;
+            }
+
+            // light_amount() only needs the z of the normal
+            float light[4] = {1, 1, 1, 1};
+            if (Shading::lit) {
+                __m128 nz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(hs.normal[2].a), dx),
+                                                  _mm_set1_ps(hs.normal[2].b * dy)),
+                                       _mm_set1_ps(hs.normal[2].c));
+                nz = _mm_andnot_ps(_mm_set1_ps(-0.0f), nz);
+                _mm_storeu_ps(light, _mm_add_ps(_mm_mul_ps(nz, _mm_set1_ps(0.9f)),
+                                                _mm_set1_ps(0.1f)));
+            }
+
+            if (!Shading::textured) {
+                for (int i = 0; i < 4; i++) {
+                    if (bits & (1 << i))
+                        fill_pixel(target, index + i, light[i]);
+                }
+                continue;
+            }
+
+            {
+                float u[4];
+                float v[4];
+                float zs[4];
+                __m128 dy4 = _mm_set1_ps(dy);
+                __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(hs.one_over_z.a), dx),
+                                                 _mm_mul_ps(_mm_set1_ps(hs.one_over_z.b), dy4)),
+                                      _mm_set1_ps(hs.one_over_z.c));
+                __m128 uw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(hs.u.a), dx),
+                                                  _mm_mul_ps(_mm_set1_ps(hs.u.b), dy4)),
+                                       _mm_set1_ps(hs.u.c));
+                __m128 vw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(hs.v.a), dx),
+                                                  _mm_mul_ps(_mm_set1_ps(hs.v.b), dy4)),
+                                       _mm_set1_ps(hs.v.c));
+                __m128 z = _mm_div_ps(_mm_set1_ps(1.0f), w);
+                _mm_storeu_ps(u, _mm_mul_ps(uw, z));
+                _mm_storeu_ps(v, _mm_mul_ps(vw, z));
+                _mm_storeu_ps(zs, z);
+
+                for (int i = 0; i < 4; i++) {
+                    if (bits & (1 << i)) {
+                        Fragment frag = {index + i, u[i], v[i], zs[i], light[i]};
+                        frags[count++] = frag;
+                    }
+                }
+            }
+
+            if (count > MAX_FRAGMENTS - 4) {
+                shade_fragments<Shading>(hs, target, frags, count);
+                count = 0;
+            }
+        }
+    }
+
+    shade_fragments<Shading>(hs, target, frags, count);
+    target.stats->shaded_pixels += shaded;
+    target.stats->depth_pixels += rejected;
+}
+
+template <class Shading>
+__attribute__((target("avx2")))
+static void raster_avx2(const HalfSpace &hs, const RasterTarget &target)
+{
+    const __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 xmin = _mm256_set1_ps((float)hs.x0);
+    const __m256 xmax = _mm256_set1_ps((float)hs.x1);
+
+    Fragment frags[MAX_FRAGMENTS];
+    int count = 0;
+    unsigned long long shaded = 0;
+    unsigned long long rejected = 0;
+
+    __m256 edge_a[3];
+    __m256 top_left[3];
+    for (int i = 0; i < 3; i++) {
+        edge_a[i] = _mm256_set1_ps(hs.edge[i].a);
+        top_left[i] = _mm256_castsi256_ps(_mm256_set1_epi32(hs.top_left[i] ? -1 : 0));
+    }
+
+    for (int y = hs.y0; y < hs.y1; y++) {
+        float dy = (float)y - hs.oy;
+        int xstart, xend;
+        if (!row_span(hs, dy, xstart, xend))
+            continue;
+
+        int xfirst = xstart & ~7;
+
+        __m256 edge_row[3];
+        for (int i = 0; i < 3; i++)
+            edge_row[i] = _mm256_set1_ps(hs.edge[i].b * dy + hs.edge[i].c);
+        float row_depth = hs.depth.b * dy + hs.depth.c;
+        __m256 depth_row = _mm256_set1_ps(row_depth);
+
+        for (int x = xfirst; x < xend; x += 8) {
+            // depth is linear along the row, so the chunk's ends bound it
+            if (target.hiz) {
+                float first = hs.depth.a * ((float)x - hs.ox) + row_depth;
+                float last = hs.depth.a * ((float)(x + 7) - hs.ox) + row_depth;
+                float zmax = target.hiz[x / HIZ_BLOCK + (y / HIZ_BLOCK) * target.hiz_stride];
+                if (std::min(first, last) > zmax + HIZ_EPSILON) {
+                    target.stats->hiz_pixels += std::min(x + 8, xend) - std::max(x, xstart);
+                    continue;
+                }
+            }
+
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), lane);
+            __m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(hs.ox));
+
+            __m256 mask = _mm256_and_ps(_mm256_cmp_ps(px, xmin, _CMP_GE_OQ),
+                                        _mm256_cmp_ps(px, xmax, _CMP_LT_OQ));
+            for (int i = 0; i < 3; i++) {
+                __m256 e = _mm256_add_ps(_mm256_mul_ps(edge_a[i], dx), edge_row[i]);
+                __m256 inside = _mm256_or_ps(_mm256_cmp_ps(e, zero, _CMP_GT_OQ),
+                                             _mm256_and_ps(_mm256_cmp_ps(e, zero, _CMP_EQ_OQ),
+                                                           top_left[i]));
+                mask = _mm256_and_ps(mask, inside);
+            }
+
+            int covered = _mm256_movemask_ps(mask);
+            if (!covered)
+                continue;
+
+            int index = x + y * target.stride;
+            bool full = x + 8 <= hs.x1;
+
+            __m256 stored;
+            if (full) {
+                stored = _mm256_loadu_ps(&target.depth[index]);
+            } else {
+                __m256i load = _mm256_castps_si256(mask);
+                stored = _mm256_maskload_ps(&target.depth[index], load);
+            }
+
+            __m256 depth = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hs.depth.a), dx), depth_row);
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(depth, stored, _CMP_LE_OQ));
+
+            int bits = _mm256_movemask_ps(mask);
+            shaded += __builtin_popcount(bits);
+            rejected += __builtin_popcount(covered & ~bits);
+            if (!bits)
+                continue;
+
+            if (full) {
+                _mm256_storeu_ps(&target.depth[index], _mm256_blendv_ps(stored, depth, mask));
+            } else {
+                _mm256_maskstore_ps(&target.depth[index], _mm256_castps_si256(mask), depth);
+            }
+
+            if (Shading::visibility) {
+                for (int i = 0; i < 8; i++) {
+                    if (bits & (1 << i))
+                        target.ids[index + i] = target.id;
+                }
+                continue;
+            }
+
+            // light_amount() only needs the z of the normal
+            float light[8] = {1, 1, 1, 1, 1, 1, 1, 1};
+            if (Shading::lit) {
+                __m256 nz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hs.normal[2].a), dx),
+                                                        _mm256_set1_ps(hs.normal[2].b * dy)),
+                                          _mm256_set1_ps(hs.normal[2].c));
+                nz = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), nz);
+                _mm256_storeu_ps(light, _mm256_add_ps(_mm256_mul_ps(nz, _mm256_set1_ps(0.9f)),
+                                                      _mm256_set1_ps(0.1f)));
+            }
+
+            if (!Shading::textured) {
+                for (int i = 0; i < 8; i++) {
+                    if (bits & (1 << i))
+                        fill_pixel(target, index + i, light[i]);
+                }
+                continue;
+            }
+
+            {
+                float u[8];
+                float v[8];
+                float zs[8];
+                __m256 dy8 = _mm256_set1_ps(dy);
+                __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hs.one_over_z.a), dx),
+                                                       _mm256_mul_ps(_mm256_set1_ps(hs.one_over_z.b), dy8)),
+                                         _mm256_set1_ps(hs.one_over_z.c));
+                __m256 uw = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hs.u.a), dx),
+                                                        _mm256_mul_ps(_mm256_set1_ps(hs.u.b), dy8)),
+                                          _mm256_set1_ps(hs.u.c));
+                __m256 vw = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hs.v.a), dx),
+                                                        _mm256_mul_ps(_mm256_set1_ps(hs.v.b), dy8)),
+                                          _mm256_set1_ps(hs.v.c));
+                __m256 z = _mm256_div_ps(_mm256_set1_ps(1.0f), w);
+                _mm256_storeu_ps(u, _mm256_mul_ps(uw, z));
+                _mm256_storeu_ps(v, _mm256_mul_ps(vw, z));
+                _mm256_storeu_ps(zs, z);
+
+                for (int i = 0; i < 8; i++) {
+                    if (bits & (1 << i)) {
+                        Fragment frag = {index + i, u[i], v[i], zs[i], light[i]};
+                        frags[count++] = frag;
+                    }
+                }
+            }
+
+            if (count > MAX_FRAGMENTS - 8) {
+                _mm256_zeroupper();
+                shade_fragments<Shading>(hs, target, frags, count);
+                count = 0;
+            }
+        }
+    }
+
+    _mm256_zeroupper();
+    shade_fragments<Shading>(hs, target, frags, count);
+    target.stats->shaded_pixels += shaded;
+    target.stats->depth_pixels += rejected;
+}
+
+void raster_halfspace_sse41(const HalfSpace &hs, const RasterTarget &target)
+{
+    switch (target.shading) {
+    case SHADE_FLAT:
+        raster_sse41<FlatShading>(hs, target);
+        break;
+    case SHADE_TEXTURED:
+        raster_sse41<TexturedShading>(hs, target);
+        break;
+    case SHADE_LIT:
+        raster_sse41<LitShading>(hs, target);
+        break;
+    case SHADE_TEXTURED_LIT:
+        raster_sse41<TexturedLitShading>(hs, target);
+        break;
+    case SHADE_VISIBILITY:
+        raster_sse41<VisibilityShading>(hs, target);
+        break;
+    }
+}
+
+void raster_halfspace_avx2(const HalfSpace &hs, const RasterTarget &target)
+{
+    switch (target.shading) {
+    case SHADE_FLAT:
+        raster_avx2<FlatShading>(hs, target);
+        break;
+    case SHADE_TEXTURED:
+        raster_avx2<TexturedShading>(hs, target);
+        break;
+    case SHADE_LIT:
+        raster_avx2<LitShading>(hs, target);
+        break;
+    case SHADE_TEXTURED_LIT:
+        raster_avx2<TexturedLitShading>(hs, target);
+        break;
+    case SHADE_VISIBILITY:
+        raster_avx2<VisibilityShading>(hs, target);
+        break;
+    }
+}
+
+#else
+
+// never selected, raster_kernel_supported() only reports the scanline path
+void raster_halfspace_sse41(const HalfSpace &hs, const RasterTarget &target) {}
+void raster_halfspace_avx2(const HalfSpace &hs, const RasterTarget &target) {}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef HALFSPACE_H
+#define HALFSPACE_H
+
+#include "vertex.h"
+#include "shading.h"
+
+class Texture;
+struct RenderStats;
+
+enum RasterKernel
+{
+    RASTER_SCANLINE,
+    RASTER_SSE41,
+    RASTER_AVX2
+};
+
+RasterKernel best_raster_kernel();
+bool raster_kernel_supported(RasterKernel kernel);
+
+// a*(x - origin x) + b*(y - origin y) + c
+struct Plane
+{
+    float a;
+    float b;
+    float c;
+};
+
+// edge functions and attribute planes of a triangle, evaluated at integer
+// pixel positions like the scanline rasterizer. The bounds take in every
+// pixel center within pad of the triangle, multisampling needs half a pixel.
+struct HalfSpace
+{
+    HalfSpace(const Vertex &v0,
+              const Vertex &v1,
+              const Vertex &v2,
+              int xmin, int ymin,
+              int xmax, int ymax,
+              float pad = 0.0f);
+
+    bool empty() const {return x0 >= x1 || y0 >= y1;}
+
+    float ox;
+    float oy;
+    Plane edge[3];
+    bool top_left[3];
+    Plane depth;
+    Plane one_over_z;
+    Plane u;
+    Plane v;
+    Plane normal[3];
+
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+#define NO_TRIANGLE 0xffffffffu
+#define MAX_SAMPLES 8
+
+struct RasterTarget
+{
+    float *data;
+    float *depth;
+    int stride;
+    // colors and depths stored per pixel, only raster_halfspace_msaa()
+    // handles more than one
+    int samples;
+    const Texture *texture;
+    ShadingMode shading;
+
+    // visibility buffer and the id SHADE_VISIBILITY writes into it
+    unsigned int *ids;
+    unsigned int id;
+
+    // max depth per HIZ_BLOCK square, NULL to skip span rejection
+    const float *hiz;
+    int hiz_stride;
+    RenderStats *stats;
+};
+
+void raster_halfspace_sse41(const HalfSpace &hs, const RasterTarget &target);
+void raster_halfspace_avx2(const HalfSpace &hs, const RasterTarget &target);
+
+// tests depth and coverage at target.samples points per pixel and shades
+// each pixel a triangle covers once, at the center when it is covered.
+void raster_halfspace_msaa(const HalfSpace &hs, const RasterTarget &target);
+
+// shades rows y0 to y1 of target.ids with target.shading, each id indexes
+// triangles. Pixels get the values the half-space kernels would give them.
+void resolve_visibility(const HalfSpace *triangles, const RasterTarget &target,
+                        int width, int y0, int y1);
+
+#endif // HALFSPACE_H
@@ -0,0 +1,228 @@
+#include "imagewriter.h"
+
+#include <ImfRgbaFile.h>
+#include <ImfHeader.h>
+#include <zlib.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <vector>
+
+#define PNG_CHUNK_SIZE (1 << 16)
+
+static std::string extension(const std::string &path)
+{
+    size_t pos = path.find_last_of(".");
+    if (pos == std::string::npos)
+        return "";
+
+    std::string ext = path.substr(pos + 1);
+    for (size_t i = 0; i < ext.size(); i++)
+        ext[i] = tolower(ext[i]);
+    return ext;
+}
+
+bool native_image_format(const std::string &path)
+{
+    std::string ext = extension(path);
+    return ext == "png" || ext == "exr";
+}
+
+// same rounding Magick uses when going to 8 bits
+static inline uint8_t to_byte(float value)
+{
+    if (!(value > 0))
+        return 0;
+    if (value >= 1)
+        return 255;
+    return (uint8_t)(value * 255.0f + 0.5f);
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static bool write_chunk(FILE *f, const char *type, const uint8_t *data, uint32_t size)
+{
+    uint8_t header[8];
+    put_u32(header, size);
+    std::copy(type, type + 4, header + 4);
+
+    uLong crc = crc32(0, header + 4, 4);
+    if (size)
+        crc = crc32(crc, data, size);
+
+    uint8_t footer[4];
+    put_u32(footer, crc);
+
+    return fwrite(header, 1, 8, f) == 8 &&
+           (!size || fwrite(data, 1, size, f) == size) &&
+           fwrite(footer, 1, 4, f) == 4;
+}
+
+static bool write_png(const std::string &path,
+                      const float *rgba,
+                      int width,
+                      int height,
+                      int level)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        std::cerr << "error opening " << path << " for writing\n";
+        return false;
+    }
+
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    uint8_t ihdr[13];
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = 6;  // RGBA
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+
+    bool ok = fwrite(signature, 1, 8, f) == 8 &&
+              write_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+
+    z_stream stream = z_stream();
+    if (deflateInit(&stream, std::max(0, std::min(level, 9))) != Z_OK) {
+        fclose(f);
+        std::cerr << "error starting png compression for " << path << "\n";
+        return false;
+    }
+
+    // each row gets a filter byte, "up" unless compression is off
+    const size_t row_size = (size_t)width * 4;
+    const uint8_t filter = level > 0 ? 2 : 0;
+    std::vector<uint8_t> row(row_size + 1);
+    std::vector<uint8_t> prev(row_size, 0);
+    std::vector<uint8_t> pixels(row_size);
+    std::vector<uint8_t> out(PNG_CHUNK_SIZE);
+
+    stream.next_out = &out[0];
+    stream.avail_out = out.size();
+
+    for (int y = height - 1; ok && y >= -1; y--) {
+        int flush = Z_NO_FLUSH;
+        if (y >= 0) {
+            const float *src = rgba + (size_t)y * row_size;
+            for (size_t i = 0; i < row_size; i++)
+                pixels[i] = to_byte(src[i]);
+
+            row[0] = filter;
+            if (filter) {
+                for (size_t i = 0; i < row_size; i++)
+                    row[i + 1] = pixels[i] - prev[i];
+                prev.swap(pixels);
+            } else {
+                std::copy(pixels.begin(), pixels.end(), row.begin() + 1);
+            }
+
+            stream.next_in = &row[0];
+            stream.avail_in = row.size();
+        } else {
+            flush = Z_FINISH;
+        }
+
+        for (;;) {
+            int result = deflate(&stream, flush);
+            if (result == Z_STREAM_ERROR) {
+                ok = false;
+                break;
+            }
+
+            if (!stream.avail_out || result == Z_STREAM_END) {
+                ok = write_chunk(f, "IDAT", &out[0], out.size() - stream.avail_out);
+                stream.next_out = &out[0];
+                stream.avail_out = out.size();
+            }
+
+            if (!ok || result == Z_STREAM_END)
+                break;
+            if (flush == Z_NO_FLUSH && !stream.avail_in && stream.avail_out)
+                break;
+        }
+    }
+
+    deflateEnd(&stream);
+
+    ok = ok && write_chunk(f, "IEND", NULL, 0);
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok)
+        std::cerr << "error writing " << path << "\n";
+    return ok;
+}
+
+static Imf::Compression exr_compression(ExrCompression compression)
+{
+    switch (compression) {
+    case EXR_NONE:
+        return Imf::NO_COMPRESSION;
+    case EXR_RLE:
+        return Imf::RLE_COMPRESSION;
+    case EXR_ZIPS:
+        return Imf::ZIPS_COMPRESSION;
+    case EXR_PIZ:
+        return Imf::PIZ_COMPRESSION;
+    case EXR_ZIP:
+    default:
+        return Imf::ZIP_COMPRESSION;
+    }
+}
+
+static bool write_exr(const std::string &path,
+                      const float *rgba,
+                      int width,
+                      int height,
+                      ExrCompression compression)
+{
+    // half conversion and the flip happen in the same pass
+    std::vector<Imf::Rgba> pixels((size_t)width * height);
+    for (int y = 0; y < height; y++) {
+        const float *src = rgba + (size_t)(height - 1 - y) * width * 4;
+        Imf::Rgba *dst = &pixels[(size_t)y * width];
+        for (int x = 0; x < width; x++) {
+            dst[x] = Imf::Rgba(src[0], src[1], src[2], src[3]);
+            src += 4;
+        }
+    }
+
+    try {
+        Imf::Header header(width, height);
+        header.compression() = exr_compression(compression);
+
+        Imf::RgbaOutputFile file(path.c_str(), header, Imf::WRITE_RGBA);
+        file.setFrameBuffer(&pixels[0], 1, width);
+        file.writePixels(height);
+    } catch (std::exception &e) {
+        std::cerr << "error writing " << path << ": " << e.what() << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool write_image(const std::string &path,
+                 const float *rgba,
+                 int width,
+                 int height,
+                 const ImageWriteOptions &options)
+{
+    std::string ext = extension(path);
+    if (ext == "png")
+        return write_png(path, rgba, width, height, options.png_compression);
+    if (ext == "exr")
+        return write_exr(path, rgba, width, height, options.exr_compression);
+
+    std::cerr << "unsupported image format " << path << "\n";
+    return false;
+}
@@ -0,0 +1,38 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <string>
+
+enum ExrCompression
+{
+    EXR_NONE,
+    EXR_RLE,
+    EXR_ZIPS,
+    EXR_ZIP,
+    EXR_PIZ
+};
+
+struct ImageWriteOptions
+{
+    ImageWriteOptions() :
+        png_compression(6),
+        exr_compression(EXR_ZIP)
+    {}
+
+    // zlib level 0-9
+    int png_compression;
+    ExrCompression exr_compression;
+};
+
+// true when write_image can encode the path's extension itself
+bool native_image_format(const std::string &path);
+
+// writes a float RGBA framebuffer, rows are stored bottom up like
+// RenderContext::data. Returns false and logs on failure.
+bool write_image(const std::string &path,
+                 const float *rgba,
+                 int width,
+                 int height,
+                 const ImageWriteOptions &options);
+
+#endif // IMAGEWRITER_H
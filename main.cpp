@@ -1,10 +1,13 @@
 #include "rendercontext.h"
 #include "abcrender.h"
+#include "farm.h"
+#include "server.h"
 #include "vertex.h"
 
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <thread>
 #include <stdlib.h>
 
 #include <Alembic/Abc/All.h>
@@ -15,11 +18,31 @@ using namespace std;
 void usage_message(const char argv0[])
 {
     cerr << "usage: " << argv0 << " [options] file.abc [dest.%04d.ext]" << endl;
+    cerr << "       " << argv0 << " [options] --serve socket" << endl;
     cerr << "       -t --texture         texture to use on geometry." << endl;
+    cerr << "          --texture-format  texture storage rgba8, half or float [default: from the image depth]" << endl;
     cerr << "       -i --imageplane      background image.%04d.jpg." << endl;
     cerr << "       -s --start           start frame." << endl;
     cerr << "       -e --end             end frame." << endl;
+    cerr << "          --prefetch        image plane frames read ahead [default: 0]" << endl;
+    cerr << "          --cache-mb        memory for decoded mesh samples shared between frames [default: 0]" << endl;
     cerr << "          --size            rendered image size [default: \"1920x1080\"]" << endl;
+    cerr << "          --threads         rasterizer and archive read threads [default: number of cores]" << endl;
+    cerr << "       -j --jobs            frames rendered concurrently [default: 1]" << endl;
+    cerr << "          --workers         processes rendering chunks of frames [default: 0, render in this one]" << endl;
+    cerr << "          --chunk           frames a worker takes at a time [default: 4]" << endl;
+    cerr << "          --queue           directory of the worker queue, shared to render on more hosts [default: temporary]" << endl;
+    cerr << "          --raster          rasterizer kernel scanline, sse4 or avx2 [default: best supported]" << endl;
+    cerr << "          --write-threads   threads writing images [default: 1]" << endl;
+    cerr << "          --write-queue     rendered frames waiting to be written [default: 2]" << endl;
+    cerr << "          --png-compression png zlib level 0-9 [default: 6]" << endl;
+    cerr << "          --exr-compression exr compression none, rle, zips, zip or piz [default: zip]" << endl;
+    cerr << "       -l --lighting        shade geometry with a headlight." << endl;
+    cerr << "          --visibility      shade each visible pixel once after all geometry is drawn." << endl;
+    cerr << "          --msaa            anti-alias with 4 or 8 depth samples per pixel." << endl;
+    cerr << "          --no-dedup        render every frame, even when nothing changed since the last one." << endl;
+    cerr << "          --trace           write a chrome trace of every frame's stages to file.json" << endl;
+    cerr << "          --serve           render frames requested on a unix socket, keeping archives and textures open." << endl;
     cerr << "       -h --help            display this usage information." << endl;
 }
 
@@ -81,6 +104,65 @@ static bool parse_int(const std::string &str, int &result)
     return true;
 }
 
+static bool parse_raster_kernel(const std::string &str, RasterKernel &result)
+{
+    // not set ignore
+    if (str.empty())
+        return true;
+
+    RasterKernel kernel;
+    if (str == "scanline")
+        kernel = RASTER_SCANLINE;
+    else if (str == "sse4")
+        kernel = RASTER_SSE41;
+    else if (str == "avx2")
+        kernel = RASTER_AVX2;
+    else
+        return false;
+
+    if (!raster_kernel_supported(kernel))
+        return false;
+
+    result = kernel;
+    return true;
+}
+
+static bool parse_texture_format(const std::string &str, TextureFormat &result)
+{
+    if (str == "rgba8")
+        result = TEXTURE_RGBA8;
+    else if (str == "half")
+        result = TEXTURE_HALF;
+    else if (str == "float")
+        result = TEXTURE_FLOAT;
+    else
+        return false;
+
+    return true;
+}
+
+static bool parse_exr_compression(const std::string &str, ExrCompression &result)
+{
+    // not set ignore
+    if (str.empty())
+        return true;
+
+    if (str == "none")
+        result = EXR_NONE;
+    else if (str == "rle")
+        result = EXR_RLE;
+    else if (str == "zips")
+        result = EXR_ZIPS;
+    else if (str == "zip")
+        result = EXR_ZIP;
+    else if (str == "piz")
+        result = EXR_PIZ;
+    else
+        return false;
+
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
 
@@ -89,6 +171,8 @@ int main(int argc, char* argv[])
            return 1;
     }
 
+    Magick::InitializeMagick(*argv);
+
     std::vector<std::string> args;
 
     std::string texture_arg = "";
@@ -96,6 +180,25 @@ int main(int argc, char* argv[])
     std::string start_arg = "";
     std::string end_arg = "";
     std::string size_arg = "";
+    std::string threads_arg = "";
+    std::string jobs_arg = "";
+    std::string workers_arg = "";
+    std::string chunk_arg = "";
+    std::string queue_arg = "";
+    std::string raster_arg = "";
+    std::string texture_format_arg = "";
+    std::string prefetch_arg = "";
+    std::string cache_mb_arg = "";
+    std::string write_threads_arg = "";
+    std::string write_queue_arg = "";
+    std::string png_compression_arg = "";
+    std::string exr_compression_arg = "";
+    std::string trace_arg = "";
+    std::string msaa_arg = "";
+    std::string serve_arg = "";
+    bool lighting = false;
+    bool visibility = false;
+    bool dedup = true;
 
     for (int i = 1; i < argc; ++i) {
         string a(argv[i]);
@@ -116,6 +219,60 @@ int main(int argc, char* argv[])
             } else if ( (a == "--size") && i+1 < argc) {
                 size_arg =  argv[i+1];
                 i++;
+            } else if ( (a == "--threads") && i+1 < argc) {
+                threads_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "-j" || a == "--jobs") && i+1 < argc) {
+                jobs_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--workers") && i+1 < argc) {
+                workers_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--chunk") && i+1 < argc) {
+                chunk_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--queue") && i+1 < argc) {
+                queue_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--raster") && i+1 < argc) {
+                raster_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--texture-format") && i+1 < argc) {
+                texture_format_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--prefetch") && i+1 < argc) {
+                prefetch_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--cache-mb") && i+1 < argc) {
+                cache_mb_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--write-threads") && i+1 < argc) {
+                write_threads_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--write-queue") && i+1 < argc) {
+                write_queue_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--png-compression") && i+1 < argc) {
+                png_compression_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--exr-compression") && i+1 < argc) {
+                exr_compression_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--trace") && i+1 < argc) {
+                trace_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--msaa") && i+1 < argc) {
+                msaa_arg =  argv[i+1];
+                i++;
+            } else if ( (a == "--serve") && i+1 < argc) {
+                serve_arg =  argv[i+1];
+                i++;
+            } else if (a == "-l" || a == "--lighting") {
+                lighting = true;
+            } else if (a == "--visibility") {
+                visibility = true;
+            } else if (a == "--no-dedup") {
+                dedup = false;
             } else if (a == "-h" || a == "--help") {
                 usage_message(argv[0]);
                 return 0;
@@ -129,17 +286,17 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (args.size() < 1) {
+    // requests name their own archive
+    bool serve = !serve_arg.empty();
+    if (args.size() < 1 && !serve) {
         usage_message(argv[0]);
         return 1;
     }
 
-    std::string abc_path = args[0];
-    std::string dest;
-    int start_frame;
-    int end_frame;
+    std::string abc_path = serve ? "" : args[0];
+    RenderOptions options;
 
-    {
+    if (!serve) {
     AbcF::IFactory factory;
     factory.setPolicy(Abc::ErrorHandler::kQuietNoopPolicy);
     AbcF::IFactory::CoreType coreType;
@@ -149,37 +306,131 @@ int main(int argc, char* argv[])
     double f,l;
     Abc::GetArchiveStartAndEndTime(archive, f,l);
 
-    start_frame = (int)(f*fps + 0.5);
-    end_frame = (int)(l*fps + 0.5);
+    options.start_frame = (int)(f*fps + 0.5);
+    options.end_frame = (int)(l*fps + 0.5);
     }
 
-    if (!parse_int(start_arg, start_frame)) {
+    if (!parse_int(start_arg, options.start_frame)) {
         std::cerr << "error parsing start frame: \"" << start_arg << "\"" << std::endl;
         return -1;
     }
 
-    if (!parse_int(end_arg, end_frame)) {
+    if (!parse_int(end_arg, options.end_frame)) {
         std::cerr << "error parsing end frame: \"" << end_arg << "\"" << std::endl;
         return -1;
     }
 
+    if (!parse_int(workers_arg, options.workers) || options.workers < 0) {
+        std::cerr << "error parsing workers: \"" << workers_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_int(chunk_arg, options.chunk) || options.chunk < 1) {
+        std::cerr << "error parsing chunk: \"" << chunk_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    // workers split the cores between them
+    options.threads = std::thread::hardware_concurrency();
+    if (options.workers > 0)
+        options.threads /= options.workers;
+    if (options.threads < 1)
+        options.threads = 1;
+
+    if (!parse_int(threads_arg, options.threads) || options.threads < 1) {
+        std::cerr << "error parsing threads: \"" << threads_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_int(jobs_arg, options.frames_in_flight) || options.frames_in_flight < 1) {
+        std::cerr << "error parsing jobs: \"" << jobs_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_raster_kernel(raster_arg, options.kernel)) {
+        std::cerr << "unsupported raster kernel: \"" << raster_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!texture_format_arg.empty()) {
+        if (!parse_texture_format(texture_format_arg, options.texture_format)) {
+            std::cerr << "unsupported texture format: \"" << texture_format_arg << "\"" << std::endl;
+            return -1;
+        }
+        options.texture_format_set = true;
+    }
+
+    if (!parse_int(prefetch_arg, options.prefetch) || options.prefetch < 0) {
+        std::cerr << "error parsing prefetch: \"" << prefetch_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_int(cache_mb_arg, options.cache_mb) || options.cache_mb < 0) {
+        std::cerr << "error parsing cache size: \"" << cache_mb_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_int(write_threads_arg, options.write_threads) || options.write_threads < 1) {
+        std::cerr << "error parsing write threads: \"" << write_threads_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_int(write_queue_arg, options.write_queue) || options.write_queue < 0) {
+        std::cerr << "error parsing write queue: \"" << write_queue_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    ImageWriteOptions &write_options = options.write_options;
+    if (!parse_int(png_compression_arg, write_options.png_compression) ||
+            write_options.png_compression < 0 || write_options.png_compression > 9) {
+        std::cerr << "error parsing png compression: \"" << png_compression_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_exr_compression(exr_compression_arg, write_options.exr_compression)) {
+        std::cerr << "unsupported exr compression: \"" << exr_compression_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (!parse_int(msaa_arg, options.samples) ||
+            (options.samples != 1 && options.samples != 4 && options.samples != 8)) {
+        std::cerr << "unsupported msaa samples: \"" << msaa_arg << "\"" << std::endl;
+        return -1;
+    }
+
+    if (options.samples > 1 && visibility) {
+        std::cerr << "--msaa can't be combined with --visibility" << std::endl;
+        return -1;
+    }
+
     Magick::Geometry size(1920, 1080);
 
     if (!size_arg.empty()) {
         size = size_arg;
     }
+    options.width = size.width();
+    options.height = size.height();
 
     if (args.size() > 1)
-        dest = args[1];
-    else
-        dest = guess_dest_path(abc_path);
+        options.dest_path = args[1];
+    else if (!serve)
+        options.dest_path = guess_dest_path(abc_path);
+
+    options.image_path = imageplane_arg;
+    options.texture_path = texture_arg;
+    options.lighting = lighting;
+    options.visibility = visibility;
+    options.dedup = dedup;
+    options.trace_path = trace_arg;
+    options.queue_dir = queue_arg;
 
     std::cerr << texture_arg << std::endl;
 
-    return abcrender(abc_path, dest,
-                     imageplane_arg,
-                     texture_arg,
-                     start_frame, end_frame,
-                     size.width(), size.height());
-}
+    if (serve)
+        return render_server(serve_arg, options);
 
+    if (options.workers > 0)
+        return render_farm(abc_path, options);
+
+    return abcrender(abc_path, options);
+}
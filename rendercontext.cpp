@@ -3,13 +3,44 @@
 #include <glm/gtx/string_cast.hpp>
 #include <string>
 #include <cfloat>
+#include <algorithm>
 
 #define FILL_DEPTH FLT_MAX
+#define MAX_BINNED_TRIANGLES 65536
+#define HIZ_REFRESH 64
+#define HIZ_MAX_BLOCKS 16
+#define RESOLVE_ROWS 8
+
+RenderStats::RenderStats()
+{
+    triangles = 0;
+    backface_triangles = 0;
+    hiz_triangles = 0;
+    hiz_pixels = 0;
+    shaded_pixels = 0;
+    depth_pixels = 0;
+}
+
+void RenderStats::add(const RenderStats &other)
+{
+    triangles += other.triangles;
+    backface_triangles += other.backface_triangles;
+    hiz_triangles += other.hiz_triangles;
+    hiz_pixels += other.hiz_pixels;
+    shaded_pixels += other.shaded_pixels;
+    depth_pixels += other.depth_pixels;
+}
 
 RenderContext::RenderContext(int width, int height)
 {
-    resize(width, height);
     texture = NULL;
+    pool = NULL;
+    kernel = best_raster_kernel();
+    hiz = true;
+    lighting = false;
+    visibility = false;
+    samples = 1;
+    resize(width, height);
 }
 
 void RenderContext::resize(int width, int height)
@@ -18,6 +49,19 @@ void RenderContext::resize(int width, int height)
     depth.resize(width * height);
     m_width = width;
     m_height = height;
+    m_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    m_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    m_bins.assign(m_tiles_x * m_tiles_y, std::vector<unsigned int>());
+    m_hiz_x = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+    m_hiz_y = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+    m_hiz.resize(m_hiz_x * m_hiz_y);
+    m_hiz_tiles.resize(m_tiles_x * m_tiles_y);
+    m_hiz_dirty.resize(m_hiz_x * m_hiz_y);
+    // the unbinned path draws everything through the first tile's state
+    m_tile_state.resize(std::max(m_tiles_x * m_tiles_y, 1));
+    m_ids.clear();
+    m_sample_data.clear();
+    m_sample_depth.clear();
     clear();
 }
 
@@ -25,6 +69,114 @@ void RenderContext::clear()
 {
     std::fill(data.begin(), data.end(), 0);
     std::fill(depth.begin(), depth.end(), FILL_DEPTH);
+
+    m_triangles.clear();
+    for (size_t i = 0; i < m_bins.size(); i++)
+        m_bins[i].clear();
+
+    std::fill(m_hiz.begin(), m_hiz.end(), FILL_DEPTH);
+    std::fill(m_hiz_tiles.begin(), m_hiz_tiles.end(), FILL_DEPTH);
+    std::fill(m_hiz_dirty.begin(), m_hiz_dirty.end(), 0);
+    m_stats = RenderStats();
+    for (size_t i = 0; i < m_tile_state.size(); i++)
+        m_tile_state[i] = TileState();
+
+    std::fill(m_ids.begin(), m_ids.end(), NO_TRIANGLE);
+    m_visible.clear();
+
+    std::fill(m_sample_data.begin(), m_sample_data.end(), 0);
+    std::fill(m_sample_depth.begin(), m_sample_depth.end(), FILL_DEPTH);
+}
+
+void RenderContext::resolve()
+{
+    flush();
+
+    if (samples > 1 && !m_sample_depth.empty()) {
+        int chunks = (m_height + RESOLVE_ROWS - 1) / RESOLVE_ROWS;
+        std::function<void(int)> job = [&](int chunk) {
+            int y0 = chunk * RESOLVE_ROWS;
+            resolve_samples(y0, std::min(y0 + RESOLVE_ROWS, m_height));
+        };
+
+        if (pool)
+            pool->parallel_for(chunks, job);
+        else
+            for (int i = 0; i < chunks; i++)
+                job(i);
+        return;
+    }
+
+    if (!visibility || m_visible.empty())
+        return;
+
+    RasterTarget target;
+    target.data = &data[0];
+    target.depth = &depth[0];
+    target.stride = m_width;
+    target.samples = 1;
+    target.texture = texture;
+    target.shading = shading_mode(texture != NULL, lighting);
+    target.ids = &m_ids[0];
+    target.id = NO_TRIANGLE;
+    target.hiz = NULL;
+    target.hiz_stride = 0;
+    target.stats = &m_stats;
+
+    // rows are independent, every pixel is shaded exactly once
+    int chunks = (m_height + RESOLVE_ROWS - 1) / RESOLVE_ROWS;
+    std::function<void(int)> job = [&](int chunk) {
+        int y0 = chunk * RESOLVE_ROWS;
+        resolve_visibility(&m_visible[0], target, m_width, y0, std::min(y0 + RESOLVE_ROWS, m_height));
+    };
+
+    if (pool)
+        pool->parallel_for(chunks, job);
+    else
+        for (int i = 0; i < chunks; i++)
+            job(i);
+}
+
+// alpha is the coverage, empty samples count as transparent, so edges get
+// fractional alpha to composite with. The color is the alpha weighted
+// average of the covered samples, straight like every other pixel in data.
+// depth keeps the nearest sample.
+void RenderContext::resolve_samples(int y0, int y1)
+{
+    float weight = 1.0f / samples;
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < m_width; x++) {
+            int index = x + y * m_width;
+            const float *color = &m_sample_data[index * samples * 4];
+            const float *sample_depth = &m_sample_depth[index * samples];
+
+            float sum[4] = {0, 0, 0, 0};
+            float nearest = FILL_DEPTH;
+            for (int s = 0; s < samples; s++) {
+                float alpha = color[s * 4 + 3];
+                for (int i = 0; i < 3; i++)
+                    sum[i] += color[s * 4 + i] * alpha;
+                sum[3] += alpha;
+                nearest = std::min(nearest, sample_depth[s]);
+            }
+
+            float *pixel = &data[index * 4];
+            float scale = sum[3] > 0 ? 1.0f / sum[3] : 0.0f;
+            for (int i = 0; i < 3; i++)
+                pixel[i] = sum[i] * scale;
+            pixel[3] = sum[3] * weight;
+            depth[index] = nearest;
+        }
+    }
+}
+
+RenderStats RenderContext::stats() const
+{
+    RenderStats result = m_stats;
+    for (size_t i = 0; i < m_tile_state.size(); i++)
+        result.add(m_tile_state[i].stats);
+    return result;
 }
 
 glm::vec4 RenderContext::get_pixel_linear(float x, float y) const
@@ -136,8 +288,11 @@ void RenderContext::draw_triangle(const Vertex &v1, const Vertex &v2, const Vert
     const Vertex *mid = &v2;
     const Vertex *max = &v3;
 
+    m_stats.triangles++;
+
     // cull back facing polygons
     if (min->area_x2(*max, *mid) <= 0) {
+        m_stats.backface_triangles++;
         return;
     }
 
@@ -164,29 +319,358 @@ void RenderContext::draw_triangle(const Vertex &v1, const Vertex &v2, const Vert
     //std::cerr << "mid " << glm::to_string(mid.pos) << "\n";
     //std::cerr << "max " << glm::to_string(max.pos) << "\n";
 
-    scan_triangle(*min, *mid, *max,
-                  min->area_x2(*max, *mid) >= 0);
+    bool handedness = min->area_x2(*max, *mid) >= 0;
+
+    // resolve() rebuilds the attributes from the triangle the id names
+    unsigned int id = NO_TRIANGLE;
+    if (samples > 1) {
+        if (m_sample_depth.size() != depth.size() * samples) {
+            m_sample_data.assign(data.size() * samples, 0);
+            m_sample_depth.assign(depth.size() * samples, FILL_DEPTH);
+        }
+    } else if (visibility) {
+        if (m_ids.size() != depth.size())
+            m_ids.assign(depth.size(), NO_TRIANGLE);
+        id = m_visible.size();
+        m_visible.push_back(HalfSpace(*min, *mid, *max, 0, 0, m_width, m_height));
+    }
+
+    if (!pool || pool->size() < 2) {
+        Tile tile = {0, 0, m_width, m_height, 0};
+        raster_triangle(*min, *mid, *max, handedness, id, tile);
+        return;
+    }
+
+    bin_triangle(*min, *mid, *max, handedness, id);
+}
+
+static int clamp_coord(float value, int lo, int hi)
+{
+    // also catches NaN from vertices with w == 0
+    if (!(value > lo))
+        return lo;
+    if (value > hi)
+        return hi;
+    return (int)value;
+}
+
+bool RenderContext::triangle_bounds(const Vertex &min_y,
+                                    const Vertex &mid_y,
+                                    const Vertex &max_y,
+                                    const Tile &clip,
+                                    Tile &bounds) const
+{
+    float xmin = std::min(min_y.pos.x, std::min(mid_y.pos.x, max_y.pos.x));
+    float xmax = std::max(min_y.pos.x, std::max(mid_y.pos.x, max_y.pos.x));
+
+    // edge x is stepped incrementally and can land a little past the
+    // vertices, so pad the x range by a pixel. Samples reach half a pixel
+    // past the center, pad y too when there are any.
+    float pad = samples > 1 ? 1.0f : 0.0f;
+    bounds.x0 = clamp_coord(floor(xmin) - 1, clip.x0, clip.x1);
+    bounds.x1 = clamp_coord(ceil(xmax) + 1, clip.x0, clip.x1);
+    bounds.y0 = clamp_coord(ceil(min_y.pos.y - pad), clip.y0, clip.y1);
+    bounds.y1 = clamp_coord(ceil(max_y.pos.y + pad), clip.y0, clip.y1);
+    bounds.index = clip.index;
+
+    return bounds.x0 < bounds.x1 && bounds.y0 < bounds.y1;
+}
+
+void RenderContext::bin_triangle(const Vertex &min_y,
+                                 const Vertex &mid_y,
+                                 const Vertex &max_y,
+                                 bool handedness,
+                                 unsigned int id)
+{
+    Tile screen = {0, 0, m_width, m_height, 0};
+    Tile bounds;
+
+    if (!triangle_bounds(min_y, mid_y, max_y, screen, bounds))
+        return;
+
+    int x0 = bounds.x0;
+    int y0 = bounds.y0;
+    int x1 = bounds.x1;
+    int y1 = bounds.y1;
+
+    if (m_triangles.size() >= MAX_BINNED_TRIANGLES)
+        flush();
+
+    BinnedTriangle tri = {min_y, mid_y, max_y, handedness, id};
+    unsigned int index = m_triangles.size();
+    m_triangles.push_back(tri);
+
+    for (int ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ty++) {
+        for (int tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; tx++) {
+            m_bins[tx + ty * m_tiles_x].push_back(index);
+        }
+    }
+}
+
+void RenderContext::flush()
+{
+    if (m_triangles.empty())
+        return;
+
+    std::vector<int> tiles;
+    for (size_t i = 0; i < m_bins.size(); i++) {
+        if (!m_bins[i].empty())
+            tiles.push_back(i);
+    }
+
+    // every tile owns its own slice of data and depth, bins keep the
+    // submission order so the result matches drawing them one at a time.
+    pool->parallel_for(tiles.size(), [&](int i) {
+        draw_tile(tiles[i]);
+    });
+
+    m_triangles.clear();
+    for (size_t i = 0; i < tiles.size(); i++)
+        m_bins[tiles[i]].clear();
+}
+
+void RenderContext::draw_tile(int index)
+{
+    int tx = index % m_tiles_x;
+    int ty = index / m_tiles_x;
+
+    Tile tile;
+    tile.x0 = tx * TILE_SIZE;
+    tile.y0 = ty * TILE_SIZE;
+    tile.x1 = std::min(tile.x0 + TILE_SIZE, m_width);
+    tile.y1 = std::min(tile.y0 + TILE_SIZE, m_height);
+    tile.index = index;
+
+    const std::vector<unsigned int> &bin = m_bins[index];
+    for (size_t i = 0; i < bin.size(); i++) {
+        const BinnedTriangle &tri = m_triangles[bin[i]];
+        raster_triangle(tri.min_y, tri.mid_y, tri.max_y, tri.handedness, tri.id, tile);
+    }
+
+    refresh_hiz(m_tile_state[index]);
+}
+
+void RenderContext::raster_triangle(const Vertex &min_y,
+                                    const Vertex &mid_y,
+                                    const Vertex &max_y,
+                                    bool handedness,
+                                    unsigned int id,
+                                    const Tile &tile)
+{
+    // every pixel the scan can touch lies inside bounds, so clipping to it
+    // instead of the tile doesn't change the result.
+    Tile bounds;
+    if (!triangle_bounds(min_y, mid_y, max_y, tile, bounds))
+        return;
+
+    if (hiz) {
+        float zmin = std::min(min_y.pos.z, std::min(mid_y.pos.z, max_y.pos.z));
+        if (hiz_rejected(bounds, zmin)) {
+            m_tile_state[tile.index].stats.hiz_triangles++;
+            return;
+        }
+    }
+
+    if (samples > 1) {
+        HalfSpace hs(min_y, mid_y, max_y, bounds.x0, bounds.y0, bounds.x1, bounds.y1, 0.5f);
+        if (hs.empty())
+            return;
+
+        RasterTarget target;
+        target.data = &m_sample_data[0];
+        target.depth = &m_sample_depth[0];
+        target.stride = m_width;
+        target.samples = samples;
+        target.texture = texture;
+        target.shading = shading_mode(texture != NULL, lighting);
+        target.ids = NULL;
+        target.id = NO_TRIANGLE;
+        target.hiz = hiz ? &m_hiz[0] : NULL;
+        target.hiz_stride = m_hiz_x;
+        target.stats = &m_tile_state[tile.index].stats;
+
+        raster_halfspace_msaa(hs, target);
+        if (hiz)
+            hiz_written(bounds);
+        return;
+    }
+
+    ShadingMode shading = visibility ? SHADE_VISIBILITY : shading_mode(texture != NULL, lighting);
+
+    if (kernel == RASTER_SCANLINE) {
+        switch (shading) {
+        case SHADE_FLAT:
+            scan_triangle<FlatShading>(min_y, mid_y, max_y, handedness, id, bounds);
+            break;
+        case SHADE_TEXTURED:
+            scan_triangle<TexturedShading>(min_y, mid_y, max_y, handedness, id, bounds);
+            break;
+        case SHADE_LIT:
+            scan_triangle<LitShading>(min_y, mid_y, max_y, handedness, id, bounds);
+            break;
+        case SHADE_TEXTURED_LIT:
+            scan_triangle<TexturedLitShading>(min_y, mid_y, max_y, handedness, id, bounds);
+            break;
+        case SHADE_VISIBILITY:
+            scan_triangle<VisibilityShading>(min_y, mid_y, max_y, handedness, id, bounds);
+            break;
+        }
+    } else {
+        HalfSpace hs(min_y, mid_y, max_y, bounds.x0, bounds.y0, bounds.x1, bounds.y1);
+        if (hs.empty())
+            return;
+
+        RasterTarget target;
+        target.data = &data[0];
+        target.depth = &depth[0];
+        target.stride = m_width;
+        target.samples = 1;
+        target.texture = texture;
+        target.shading = shading;
+        target.ids = visibility ? &m_ids[0] : NULL;
+        target.id = id;
+        target.hiz = hiz ? &m_hiz[0] : NULL;
+        target.hiz_stride = m_hiz_x;
+        target.stats = &m_tile_state[tile.index].stats;
+
+        if (kernel == RASTER_AVX2)
+            raster_halfspace_avx2(hs, target);
+        else
+            raster_halfspace_sse41(hs, target);
+    }
+
+    if (hiz)
+        hiz_written(bounds);
+}
+
+bool RenderContext::hiz_rejected(const Tile &bounds, float zmin) const
+{
+    // a tile's max is never nearer than its blocks', so try it first
+    float zmax = -FLT_MAX;
+    for (int ty = bounds.y0 / TILE_SIZE; ty <= (bounds.y1 - 1) / TILE_SIZE; ty++) {
+        for (int tx = bounds.x0 / TILE_SIZE; tx <= (bounds.x1 - 1) / TILE_SIZE; tx++) {
+            zmax = std::max(zmax, m_hiz_tiles[tx + ty * m_tiles_x]);
+        }
+    }
+
+    if (zmin > zmax + HIZ_EPSILON)
+        return true;
+
+    int bx0 = bounds.x0 / HIZ_BLOCK;
+    int by0 = bounds.y0 / HIZ_BLOCK;
+    int bx1 = (bounds.x1 - 1) / HIZ_BLOCK;
+    int by1 = (bounds.y1 - 1) / HIZ_BLOCK;
+
+    if ((bx1 - bx0 + 1) * (by1 - by0 + 1) > HIZ_MAX_BLOCKS)
+        return false;
+
+    zmax = -FLT_MAX;
+    for (int by = by0; by <= by1; by++) {
+        for (int bx = bx0; bx <= bx1; bx++) {
+            zmax = std::max(zmax, m_hiz[bx + by * m_hiz_x]);
+        }
+    }
+
+    return zmin > zmax + HIZ_EPSILON;
+}
+
+void RenderContext::hiz_written(const Tile &bounds)
+{
+    TileState &state = m_tile_state[bounds.index];
+
+    for (int by = bounds.y0 / HIZ_BLOCK; by <= (bounds.y1 - 1) / HIZ_BLOCK; by++) {
+        for (int bx = bounds.x0 / HIZ_BLOCK; bx <= (bounds.x1 - 1) / HIZ_BLOCK; bx++) {
+            int block = bx + by * m_hiz_x;
+            if (!m_hiz_dirty[block]) {
+                m_hiz_dirty[block] = 1;
+                state.dirty_blocks.push_back(block);
+            }
+        }
+    }
+
+    // rebuilding the blocks after every triangle costs as much as drawing
+    // small triangles, do it in batches.
+    if (++state.pending >= HIZ_REFRESH)
+        refresh_hiz(state);
+}
+
+void RenderContext::refresh_hiz(TileState &state)
+{
+    std::vector<int> tiles;
+
+    for (size_t i = 0; i < state.dirty_blocks.size(); i++) {
+        int block = state.dirty_blocks[i];
+        int bx = block % m_hiz_x;
+        int by = block / m_hiz_x;
+
+        int x0 = bx * HIZ_BLOCK;
+        int y0 = by * HIZ_BLOCK;
+        int x1 = std::min(x0 + HIZ_BLOCK, m_width);
+        int y1 = std::min(y0 + HIZ_BLOCK, m_height);
+
+        // a pixel's samples are next to each other, so a block row of
+        // them is one run
+        const float *buffer = samples > 1 ? &m_sample_depth[0] : &depth[0];
+        int run = (x1 - x0) * samples;
+        float zmax = -FLT_MAX;
+        for (int y = y0; y < y1; y++) {
+            const float *row = &buffer[(x0 + y * m_width) * samples];
+            for (int i = 0; i < run; i++)
+                zmax = std::max(zmax, row[i]);
+        }
+
+        m_hiz[block] = zmax;
+        m_hiz_dirty[block] = 0;
+        tiles.push_back(x0 / TILE_SIZE + (y0 / TILE_SIZE) * m_tiles_x);
+    }
+
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+
+    const int blocks_per_tile = TILE_SIZE / HIZ_BLOCK;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        int bx0 = (tiles[i] % m_tiles_x) * blocks_per_tile;
+        int by0 = (tiles[i] / m_tiles_x) * blocks_per_tile;
+        int bx1 = std::min(bx0 + blocks_per_tile, m_hiz_x);
+        int by1 = std::min(by0 + blocks_per_tile, m_hiz_y);
+
+        float zmax = -FLT_MAX;
+        for (int by = by0; by < by1; by++) {
+            for (int bx = bx0; bx < bx1; bx++)
+                zmax = std::max(zmax, m_hiz[bx + by * m_hiz_x]);
+        }
+        m_hiz_tiles[tiles[i]] = zmax;
+    }
+
+    state.dirty_blocks.clear();
+    state.pending = 0;
 }
 
+template <class Shading>
 void RenderContext::scan_triangle(const Vertex &min_y,
                                   const Vertex &mid_y,
                                   const Vertex &max_y,
-                                  bool handedness)
+                                  bool handedness,
+                                  unsigned int id,
+                                  const Tile &tile)
 {
     Gradient grad(min_y, mid_y, max_y);
     Edge top_bottom(grad, min_y, max_y, 0);
     Edge top_middle(grad, min_y, mid_y, 0);
     Edge middle_bottom(grad, mid_y, max_y, 1);
 
-    scan_edge(grad, top_bottom, top_middle, handedness);
-    scan_edge(grad, top_bottom, middle_bottom, handedness);
+    scan_edge<Shading>(grad, top_bottom, top_middle, handedness, id, tile);
+    scan_edge<Shading>(grad, top_bottom, middle_bottom, handedness, id, tile);
 
 }
 
+template <class Shading>
 void RenderContext::scan_edge(const Gradient &grad,
                               Edge &a,
                               Edge &b,
-                              bool handedness)
+                              bool handedness,
+                              unsigned int id,
+                              const Tile &tile)
 {
     Edge *left = &a;
     Edge *right = &b;
@@ -198,69 +682,149 @@ void RenderContext::scan_edge(const Gradient &grad,
     }
 
     int ystart = b.ystart();
-    int yend = b.yend();
+    int yend = std::min(b.yend(), tile.y1);
 
+    // edges are stepped through the rows above the tile too, so every
+    // tile sees the same values as an unclipped scan.
     for (int y = ystart; y < yend; y++) {
-        draw_scanline(grad, *left, *right, y);
+        if (y >= tile.y0)
+            draw_scanline<Shading>(grad, *left, *right, y, id, tile);
         left->step();
         right->step();
     }
 }
 
+template <class Shading>
 void RenderContext::draw_scanline(const Gradient &grad,
                                   const Edge &left,
                                   const Edge &right,
-                                  float y)
+                                  float y,
+                                  unsigned int id,
+                                  const Tile &tile)
 {
     int xmin = (int)ceil(left.x());
-    int xmax = (int)ceil(right.x());
+    int xmax = std::min((int)ceil(right.x()), tile.x1);
 
     float xprestep = (float)xmin - (float)left.x();
 
     glm::vec3 bary_step = grad.barystep_x();
-    glm::vec3 bary = left.bary() + (grad.barystep_x() * xprestep);
-
-    for(int x = xmin; x < xmax; x++) {
-        float depth = (grad.depth[0] * bary.x) +
-                      (grad.depth[1] * bary.y) +
-                      (grad.depth[2] * bary.z);
+    glm::vec3 bary_start = left.bary() + (grad.barystep_x() * xprestep);
+
+    // screen space derivatives of u/z, v/z and 1/z, constant per triangle
+    glm::vec2 duv_dx;
+    glm::vec2 duv_dy;
+    float done_over_z_dx = 0;
+    float done_over_z_dy = 0;
+    if (Shading::textured) {
+        glm::vec3 bary_step_y = grad.barystep_y();
+        duv_dx = (grad.uv[0] * bary_step.x) +
+                 (grad.uv[1] * bary_step.y) +
+                 (grad.uv[2] * bary_step.z);
+        duv_dy = (grad.uv[0] * bary_step_y.x) +
+                 (grad.uv[1] * bary_step_y.y) +
+                 (grad.uv[2] * bary_step_y.z);
+        done_over_z_dx = (grad.one_over_z[0] * bary_step.x) +
+                         (grad.one_over_z[1] * bary_step.y) +
+                         (grad.one_over_z[2] * bary_step.z);
+        done_over_z_dy = (grad.one_over_z[0] * bary_step_y.x) +
+                         (grad.one_over_z[1] * bary_step_y.y) +
+                         (grad.one_over_z[2] * bary_step_y.z);
+    }
 
-        if (depth > get_depth(x, y)) {
-            bary += bary_step;
-            continue;
+    // the span is clamped to the tile, which lies inside the viewport, so
+    // pixels are addressed without bounds checks. Barycentrics are
+    // evaluated from the span start instead of stepped, so skipping to the
+    // tile costs nothing and every tile still sees the same values.
+    int x = std::max(xmin, tile.x0);
+    float *data_row = &data[(int)y * m_width * 4];
+    float *depth_row = &depth[(int)y * m_width];
+
+    unsigned long long shaded = 0;
+    unsigned long long rejected = 0;
+
+    while (x < xmax) {
+        int block_end = std::min((x / HIZ_BLOCK + 1) * HIZ_BLOCK, xmax);
+
+        // depth is linear along the span, so its ends bound the whole block
+        if (hiz) {
+            glm::vec3 bary = bary_start + bary_step * (float)(x - xmin);
+            glm::vec3 last = bary_start + bary_step * (float)(block_end - 1 - xmin);
+            float first_depth = (grad.depth[0] * bary.x) +
+                                (grad.depth[1] * bary.y) +
+                                (grad.depth[2] * bary.z);
+            float last_depth = (grad.depth[0] * last.x) +
+                               (grad.depth[1] * last.y) +
+                               (grad.depth[2] * last.z);
+            float zmax = m_hiz[x / HIZ_BLOCK + ((int)y / HIZ_BLOCK) * m_hiz_x];
+
+            if (std::min(first_depth, last_depth) > zmax + HIZ_EPSILON) {
+                m_tile_state[tile.index].stats.hiz_pixels += block_end - x;
+                x = block_end;
+                continue;
+            }
         }
 
-        float one_over_z = (grad.one_over_z[0] * bary.x) +
-                           (grad.one_over_z[1] * bary.y) +
-                           (grad.one_over_z[2] * bary.z);
-
-        float z = 1.0f/one_over_z;
-
-        glm::vec2 uv = (grad.uv[0] * bary.x) +
-                       (grad.uv[1] * bary.y) +
-                       (grad.uv[2] * bary.z);
-        uv *= z;
-
-        glm::vec4 c(1,1,1,1);
-        if (texture)
-            c = texture->get_pixel_linear(uv.x * ((float)texture->width()-1),
-                                          uv.y * ((float)texture->height()-1));
-
-        /*
-        glm::vec3 normal = (grad.normal[0] * bary.x) +
-                           (grad.normal[1] * bary.y) +
-                           (grad.normal[2] * bary.z);
-        glm::vec3 light_dir(0,0,1);
-        float light_amt = glm::length(glm::dot(normal, light_dir)) * 0.9f + 0.1f;
-
-        for (int i= 0; i < 3; i++) {
-            c[i] = c[i] * light_amt;
+        for(; x < block_end; x++) {
+            glm::vec3 bary = bary_start + bary_step * (float)(x - xmin);
+            float depth = (grad.depth[0] * bary.x) +
+                          (grad.depth[1] * bary.y) +
+                          (grad.depth[2] * bary.z);
+
+            if (depth > depth_row[x]) {
+                rejected++;
+                continue;
+            }
+
+            if (Shading::visibility) {
+                m_ids[x + (int)y * m_width] = id;
+                depth_row[x] = depth;
+                shaded++;
+                continue;
+            }
+
+            glm::vec4 c(1,1,1,1);
+
+            if (Shading::textured) {
+                float one_over_z = (grad.one_over_z[0] * bary.x) +
+                                   (grad.one_over_z[1] * bary.y) +
+                                   (grad.one_over_z[2] * bary.z);
+
+                float z = 1.0f/one_over_z;
+
+                glm::vec2 uv = (grad.uv[0] * bary.x) +
+                               (grad.uv[1] * bary.y) +
+                               (grad.uv[2] * bary.z);
+                uv *= z;
+
+                glm::vec2 uv_dx = (duv_dx - uv * done_over_z_dx) * z;
+                glm::vec2 uv_dy = (duv_dy - uv * done_over_z_dy) * z;
+                float lod = texture->lod(uv_dx.x, uv_dx.y, uv_dy.x, uv_dy.y);
+
+                c = texture->sample(uv.x, uv.y, lod);
+            }
+
+            if (Shading::lit) {
+                glm::vec3 normal = (grad.normal[0] * bary.x) +
+                                   (grad.normal[1] * bary.y) +
+                                   (grad.normal[2] * bary.z);
+                float light_amt = light_amount(normal);
+
+                for (int i= 0; i < 3; i++) {
+                    c[i] = c[i] * light_amt;
+                }
+            }
+
+            float *pixel = &data_row[x * 4];
+            pixel[0] = c.r;
+            pixel[1] = c.g;
+            pixel[2] = c.b;
+            pixel[3] = c.a;
+            depth_row[x] = depth;
+            shaded++;
         }
-        */
-
-        draw_pixel(x, y, c);
-        draw_depth(x, y, depth);
-
-        bary += bary_step;
     }
+
+    RenderStats &stats = m_tile_state[tile.index].stats;
+    stats.shaded_pixels += shaded;
+    stats.depth_pixels += rejected;
 }
@@ -4,10 +4,42 @@
 #include "vertex.h"
 #include "gradient.h"
 #include "edge.h"
+#include "halfspace.h"
+#include "shading.h"
+#include "threadpool.h"
+#include "texture.h"
 
 #include <vector>
 #include <glm/glm.hpp>
 
+#define TILE_SIZE 64
+#define HIZ_BLOCK 8
+#define HIZ_EPSILON 1e-5f
+
+struct Tile
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    int index;
+};
+
+struct RenderStats
+{
+    RenderStats();
+    void add(const RenderStats &other);
+
+    unsigned long long triangles;
+    unsigned long long backface_triangles;
+    // counted once per tile a triangle is rejected in
+    unsigned long long hiz_triangles;
+    unsigned long long hiz_pixels;
+    // covered pixels that passed and failed the depth test
+    unsigned long long shaded_pixels;
+    unsigned long long depth_pixels;
+};
+
 class RenderContext
 {
 public:
@@ -22,16 +54,82 @@ public:
     float get_depth(int x, int y) const;
     glm::vec4 get_pixel_linear(float x, float y) const;
     void draw_triangle(const Vertex &v1, const Vertex &v2, const Vertex &v3);
+    void flush();
+    // shades the visibility buffer or averages the samples into data and
+    // depth, call once every triangle is drawn
+    void resolve();
     int width() const {return m_width;}
     int height() const {return m_height;}
-    RenderContext *texture;
+    const Texture *texture;
+    ThreadPool *pool;
+    RasterKernel kernel;
+    bool hiz;
+    bool lighting;
+    // rasterize depth and triangle ids only and shade each visible pixel
+    // once in resolve()
+    bool visibility;
+    // depth and coverage samples per pixel, 4 or 8 for multisampling.
+    // Pixels are still shaded once per triangle, visibility is ignored.
+    int samples;
+    RenderStats stats() const;
 
 private:
-    void scan_triangle(const Vertex &min_y, const Vertex &mid_y, const Vertex &max_y, bool handedness);
-    void scan_edge(const Gradient &grad, Edge &a, Edge &b, bool handedness);
-    void draw_scanline(const Gradient &grad, const Edge &left, const Edge &right, float y);
+    struct BinnedTriangle
+    {
+        Vertex min_y;
+        Vertex mid_y;
+        Vertex max_y;
+        bool handedness;
+        unsigned int id;
+    };
+
+    struct TileState
+    {
+        TileState() : pending(0) {}
+        RenderStats stats;
+        std::vector<int> dirty_blocks;
+        int pending;
+    };
+
+    void bin_triangle(const Vertex &min_y, const Vertex &mid_y, const Vertex &max_y, bool handedness, unsigned int id);
+    void draw_tile(int index);
+    bool triangle_bounds(const Vertex &min_y, const Vertex &mid_y, const Vertex &max_y, const Tile &clip, Tile &bounds) const;
+    bool hiz_rejected(const Tile &bounds, float zmin) const;
+    void hiz_written(const Tile &bounds);
+    void refresh_hiz(TileState &state);
+    void resolve_samples(int y0, int y1);
+    void raster_triangle(const Vertex &min_y, const Vertex &mid_y, const Vertex &max_y, bool handedness, unsigned int id, const Tile &tile);
+    template <class Shading>
+    void scan_triangle(const Vertex &min_y, const Vertex &mid_y, const Vertex &max_y, bool handedness, unsigned int id, const Tile &tile);
+    template <class Shading>
+    void scan_edge(const Gradient &grad, Edge &a, Edge &b, bool handedness, unsigned int id, const Tile &tile);
+    template <class Shading>
+    void draw_scanline(const Gradient &grad, const Edge &left, const Edge &right, float y, unsigned int id, const Tile &tile);
     int m_width;
     int m_height;
+    int m_tiles_x;
+    int m_tiles_y;
+    std::vector<BinnedTriangle> m_triangles;
+    std::vector<std::vector<unsigned int> > m_bins;
+
+    // max depth pyramid, HIZ_BLOCK squares and whole tiles. Stale values
+    // are always too far away, so they only cost rejections.
+    int m_hiz_x;
+    int m_hiz_y;
+    std::vector<float> m_hiz;
+    std::vector<float> m_hiz_tiles;
+    std::vector<unsigned char> m_hiz_dirty;
+    RenderStats m_stats;
+    std::vector<TileState> m_tile_state;
+
+    // triangle id per pixel and the triangles drawn this frame, only used
+    // with visibility
+    std::vector<unsigned int> m_ids;
+    std::vector<HalfSpace> m_visible;
+
+    // samples consecutive per pixel, only used with multisampling
+    std::vector<float> m_sample_data;
+    std::vector<float> m_sample_depth;
 };
 
 #endif // RENDERCONTEXT_H
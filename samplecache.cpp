@@ -0,0 +1,68 @@
+#include "samplecache.h"
+
+#include <algorithm>
+
+SampleCacheStats::SampleCacheStats()
+{
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    entries = 0;
+    bytes = 0;
+    peak_bytes = 0;
+}
+
+SampleCache::SampleCache(size_t budget)
+{
+    m_budget = budget;
+}
+
+std::shared_ptr<void> SampleCache::find_value(const std::string &key)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    std::unordered_map<std::string, std::list<Entry>::iterator>::iterator found = m_index.find(key);
+    if (found == m_index.end()) {
+        m_stats.misses++;
+        return std::shared_ptr<void>();
+    }
+
+    m_stats.hits++;
+    m_entries.splice(m_entries.begin(), m_entries, found->second);
+    return found->second->value;
+}
+
+void SampleCache::insert(const std::string &key, const std::shared_ptr<void> &value, size_t bytes)
+{
+    if (!value || bytes > m_budget)
+        return;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // two readers missed the same sample, the first one's copy stays
+    if (m_index.count(key))
+        return;
+
+    while (!m_entries.empty() && m_stats.bytes + bytes > m_budget) {
+        const Entry &last = m_entries.back();
+        m_stats.bytes -= last.bytes;
+        m_stats.evictions++;
+        m_index.erase(last.key);
+        m_entries.pop_back();
+    }
+
+    Entry entry = {key, value, bytes};
+    m_entries.push_front(entry);
+    m_index[key] = m_entries.begin();
+
+    m_stats.bytes += bytes;
+    m_stats.peak_bytes = std::max(m_stats.peak_bytes, m_stats.bytes);
+}
+
+SampleCacheStats SampleCache::stats() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    SampleCacheStats result = m_stats;
+    result.entries = m_entries.size();
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef SAMPLECACHE_H
+#define SAMPLECACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct SampleCacheStats
+{
+    SampleCacheStats();
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t entries;
+    size_t bytes;
+    size_t peak_bytes;
+};
+
+// decoded samples shared by every reader in the process, keyed on the
+// archive and its file stamp, object, property and sample index. The least recently used ones
+// are dropped to stay within the budget, readers holding a dropped value
+// keep it alive until they let go of it.
+class SampleCache
+{
+public:
+    SampleCache(size_t budget);
+
+    // NULL when key isn't cached, T has to be the type it was inserted as
+    template <class T>
+    std::shared_ptr<T> find(const std::string &key)
+    {
+        return std::static_pointer_cast<T>(find_value(key));
+    }
+
+    // values bigger than the whole budget aren't kept
+    void insert(const std::string &key, const std::shared_ptr<void> &value, size_t bytes);
+
+    size_t budget() const {return m_budget;}
+    SampleCacheStats stats() const;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::shared_ptr<void> value;
+        size_t bytes;
+    };
+
+    std::shared_ptr<void> find_value(const std::string &key);
+
+    size_t m_budget;
+    // most recently used first
+    std::list<Entry> m_entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+    SampleCacheStats m_stats;
+    mutable std::mutex m_mutex;
+};
+
+#endif // SAMPLECACHE_H
@@ -0,0 +1,645 @@
+#include "server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <Magick++.h>
+
+// archives, textures and image sizes kept between requests
+#define SERVER_ARCHIVES 4
+#define SERVER_TEXTURES 4
+#define SERVER_CONTEXTS 2
+
+#define SERVER_BACKLOG 16
+// clients connected at once, more are turned away
+#define SERVER_CONNECTIONS 64
+// longest request line, anything longer closes the connection
+#define SERVER_LINE_MAX 4096
+// longest request, anything longer closes the connection
+#define SERVER_REQUEST_MAX (16 * SERVER_LINE_MAX)
+// a client that stops reading its replies for this long is dropped
+#define SERVER_SEND_TIMEOUT 10
+#define SERVER_SIZE_MAX 16384
+
+// the most recently used values by key
+template <class T>
+class WarmCache
+{
+public:
+    WarmCache(size_t size) : m_size(size) {}
+
+    std::shared_ptr<T> find(const std::string &key)
+    {
+        for (typename Entries::iterator i = m_entries.begin(); i != m_entries.end(); i++) {
+            if (i->first == key) {
+                m_entries.splice(m_entries.begin(), m_entries, i);
+                return i->second;
+            }
+        }
+        return std::shared_ptr<T>();
+    }
+
+    void insert(const std::string &key, const std::shared_ptr<T> &value)
+    {
+        for (typename Entries::iterator i = m_entries.begin(); i != m_entries.end(); i++) {
+            if (i->first == key) {
+                m_entries.erase(i);
+                break;
+            }
+        }
+
+        m_entries.push_front(std::make_pair(key, value));
+        if (m_entries.size() > m_size)
+            m_entries.pop_back();
+    }
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<T> > > Entries;
+    Entries m_entries;
+    size_t m_size;
+};
+
+struct Scene
+{
+    std::string stamp;
+    std::unique_ptr<ABCRender> renderer;
+};
+
+struct LoadedTexture
+{
+    std::string stamp;
+    std::shared_ptr<Texture> texture;
+};
+
+struct Request
+{
+    std::string archive;
+    int frame;
+    bool frame_set;
+    int width;
+    int height;
+    std::string texture;
+    bool lighting;
+    std::string output;
+};
+
+// changes whenever the file is replaced or written to
+static bool file_stamp(const std::string &path, std::string &stamp)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+
+    std::ostringstream result;
+    result << info.st_dev << ":" << info.st_ino << ":" << info.st_size << ":" << info.st_mtime;
+    stamp = result.str();
+    return true;
+}
+
+static bool parse_number(const std::string &str, int &result)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end != '\0' || errno == ERANGE || value != (int)value)
+        return false;
+    result = value;
+    return true;
+}
+
+static bool parse_size(const std::string &str, int &width, int &height)
+{
+    size_t x = str.find('x');
+    if (x == std::string::npos ||
+            !parse_number(str.substr(0, x), width) || !parse_number(str.substr(x + 1), height))
+        return false;
+    return width > 0 && height > 0 && width <= SERVER_SIZE_MAX && height <= SERVER_SIZE_MAX;
+}
+
+// the bytes a client sent so far, requests are only taken out once their
+// ending empty line is in
+class Connection
+{
+public:
+    Connection(int fd) : m_fd(fd)
+    {
+        struct timeval timeout;
+        timeout.tv_sec = SERVER_SEND_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    ~Connection()
+    {
+        release_shared();
+        close(m_fd);
+    }
+
+    int fd() const {return m_fd;}
+
+    // reads what the client sent, false once it is gone or sent too much
+    bool receive()
+    {
+        char buffer[4096];
+        ssize_t size;
+        do {
+            size = recv(m_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        } while (size < 0 && errno == EINTR);
+
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (size <= 0)
+            return false;
+        m_buffer.append(buffer, size);
+
+        // blank lines between requests
+        size_t start = m_buffer.find_first_not_of("\r\n");
+        m_buffer.erase(0, start == std::string::npos ? m_buffer.size() : start);
+        return m_buffer.size() <= SERVER_REQUEST_MAX && line_length() <= SERVER_LINE_MAX;
+    }
+
+    bool has_request() const {return request_end(NULL) != std::string::npos;}
+
+    // takes the lines of the first whole request
+    bool take_request(std::vector<std::string> &lines)
+    {
+        size_t end = request_end(&lines);
+        if (end == std::string::npos)
+            return false;
+
+        m_buffer.erase(0, end);
+        size_t start = m_buffer.find_first_not_of("\r\n");
+        m_buffer.erase(0, start == std::string::npos ? m_buffer.size() : start);
+        return true;
+    }
+
+    bool send_line(const std::string &line)
+    {
+        std::string data = line + "\n";
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t size = send(m_fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0)
+                return false;
+            done += size;
+        }
+        return true;
+    }
+
+    // copies the pixels of ctx to a new shared memory object
+    bool share(const RenderContext &ctx, std::string &name, std::string &error)
+    {
+        static int next = 0;
+        std::ostringstream shm_name;
+        shm_name << "/abcrender." << getpid() << "." << next++;
+        name = shm_name.str();
+
+        size_t size = ctx.data.size() * sizeof(float);
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            error = std::string("creating shared memory: ") + strerror(errno);
+            return false;
+        }
+        m_shared = name;
+
+        void *data = MAP_FAILED;
+        if (ftruncate(fd, size) == 0)
+            data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            error = std::string("mapping shared memory: ") + strerror(errno);
+            close(fd);
+            release_shared();
+            return false;
+        }
+
+        memcpy(data, &ctx.data[0], size);
+        munmap(data, size);
+        close(fd);
+        return true;
+    }
+
+    // clients map the last reply's memory before their next request
+    void release_shared()
+    {
+        if (!m_shared.empty())
+            shm_unlink(m_shared.c_str());
+        m_shared.clear();
+    }
+
+private:
+    // past the empty line ending the first request, npos while it isn't in
+    size_t request_end(std::vector<std::string> *lines) const
+    {
+        if (lines)
+            lines->clear();
+        size_t start = 0;
+        for (;;) {
+            size_t end = m_buffer.find('\n', start);
+            if (end == std::string::npos)
+                return std::string::npos;
+
+            std::string line = m_buffer.substr(start, end - start);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            start = end + 1;
+
+            if (line.empty())
+                return start;
+            if (lines)
+                lines->push_back(line);
+        }
+    }
+
+    // of the line still being sent
+    size_t line_length() const
+    {
+        size_t end = m_buffer.rfind('\n');
+        return end == std::string::npos ? m_buffer.size() : m_buffer.size() - end - 1;
+    }
+
+    int m_fd;
+    std::string m_buffer;
+    std::string m_shared;
+};
+
+class RenderServer
+{
+public:
+    RenderServer(const RenderOptions &options) :
+        m_options(options),
+        m_scenes(SERVER_ARCHIVES),
+        m_textures(SERVER_TEXTURES),
+        m_contexts(SERVER_CONTEXTS),
+        m_pool(std::max(options.threads - 1, 0))
+    {
+        if (m_options.cache_mb > 0)
+            m_sample_cache.reset(new SampleCache((size_t)m_options.cache_mb * 1024 * 1024));
+    }
+
+    // answers one request, false when the client can't take the reply
+    bool serve(Connection &connection, const std::vector<std::string> &lines)
+    {
+        Request request;
+        std::string error;
+        bool complete = parse_request(lines, request, error);
+
+        connection.release_shared();
+
+        std::string reply;
+        if (complete) {
+            try {
+                reply = render(connection, request, error);
+            } catch (std::exception &e) {
+                error = e.what();
+            }
+        }
+        // alembic messages span lines, replies don't
+        if (reply.empty()) {
+            std::replace(error.begin(), error.end(), '\n', ' ');
+            reply = "error " + error;
+        }
+
+        std::cerr << reply << std::endl;
+        return connection.send_line(reply);
+    }
+
+private:
+    // false for a bad request
+    bool parse_request(const std::vector<std::string> &lines, Request &request, std::string &error)
+    {
+        request.frame = 0;
+        request.frame_set = false;
+        request.width = m_options.width;
+        request.height = m_options.height;
+        request.texture = m_options.texture_path;
+        request.lighting = m_options.lighting;
+
+        for (size_t i = 0; i < lines.size() && error.empty(); i++) {
+            const std::string &line = lines[i];
+            size_t space = line.find(' ');
+            std::string key = line.substr(0, space);
+            std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+
+            if (key == "archive") {
+                request.archive = value;
+            } else if (key == "frame") {
+                request.frame_set = parse_number(value, request.frame);
+                if (!request.frame_set)
+                    error = "parsing frame: \"" + value + "\"";
+            } else if (key == "size") {
+                if (!parse_size(value, request.width, request.height))
+                    error = "parsing size: \"" + value + "\"";
+            } else if (key == "texture") {
+                request.texture = value;
+            } else if (key == "lighting") {
+                request.lighting = value == "1";
+                if (value != "0" && value != "1")
+                    error = "parsing lighting: \"" + value + "\"";
+            } else if (key == "output") {
+                request.output = value;
+            } else {
+                error = "unknown request key \"" + key + "\"";
+            }
+        }
+
+        if (!error.empty())
+            return false;
+        if (request.archive.empty() || !request.frame_set || request.output.empty()) {
+            error = "a request needs an archive, frame and output";
+            return false;
+        }
+        return true;
+    }
+
+    std::string render(Connection &connection, const Request &request, std::string &error)
+    {
+        std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
+
+        ABCRender *renderer = scene(request.archive, error);
+        if (!renderer)
+            return std::string();
+
+        std::shared_ptr<Texture> texture;
+        if (!request.texture.empty()) {
+            texture = load(request.texture, error);
+            if (!texture)
+                return std::string();
+        }
+
+        std::shared_ptr<RenderContext> ctx = context(request.width, request.height);
+        ctx->texture = texture.get();
+        ctx->lighting = request.lighting;
+
+        std::string reply;
+        try {
+            renderer->render(*ctx, request.frame);
+
+            std::ostringstream result;
+            std::string name;
+            if (request.output == "shm") {
+                if (connection.share(*ctx, name, error))
+                    result << "ok shm " << name << " " << request.width << " " << request.height;
+            } else if (write_output(request.output, *ctx, error)) {
+                result << "ok path " << request.output;
+            }
+            reply = result.str();
+        } catch (...) {
+            ctx->clear();
+            throw;
+        }
+        ctx->clear();
+
+        std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+        std::cerr << "frame " << request.frame << " of " << request.archive << " rendered in "
+                  << elapsed_seconds.count() << " secs" << std::endl;
+        return reply;
+    }
+
+    // the archive read at most once while it doesn't change
+    ABCRender *scene(const std::string &path, std::string &error)
+    {
+        std::string stamp;
+        if (!file_stamp(path, stamp)) {
+            error = "opening archive " + path + ": " + strerror(errno);
+            return NULL;
+        }
+
+        std::shared_ptr<Scene> found = m_scenes.find(path);
+        if (found && found->stamp == stamp)
+            return found->renderer.get();
+
+        // samples of the old file are keyed on its stamp, they age out of
+        // the sample cache on their own
+        if (found)
+            std::cerr << "archive " << path << " changed, reading it again" << std::endl;
+
+        std::shared_ptr<Scene> loaded(new Scene());
+        loaded->stamp = stamp;
+        loaded->renderer.reset(new ABCRender(path, m_options.threads));
+        loaded->renderer->sample_cache = m_sample_cache.get();
+
+        if (loaded->renderer->camera_list.empty()) {
+            error = "no cameras found in " + path;
+            return NULL;
+        }
+        if (loaded->renderer->mesh_list.empty()) {
+            error = "no mesh found in " + path;
+            return NULL;
+        }
+
+        m_scenes.insert(path, loaded);
+        return loaded->renderer.get();
+    }
+
+    std::shared_ptr<Texture> load(const std::string &path, std::string &error)
+    {
+        std::string stamp;
+        if (!file_stamp(path, stamp)) {
+            error = "opening texture " + path + ": " + strerror(errno);
+            return std::shared_ptr<Texture>();
+        }
+
+        std::shared_ptr<LoadedTexture> found = m_textures.find(path);
+        if (found && found->stamp == stamp)
+            return found->texture;
+
+        RenderOptions options = m_options;
+        options.texture_path = path;
+
+        std::shared_ptr<LoadedTexture> loaded(new LoadedTexture());
+        loaded->stamp = stamp;
+        loaded->texture = load_texture(options);
+        m_textures.insert(path, loaded);
+        return loaded->texture;
+    }
+
+    std::shared_ptr<RenderContext> context(int width, int height)
+    {
+        std::ostringstream key;
+        key << width << "x" << height;
+
+        std::shared_ptr<RenderContext> ctx = m_contexts.find(key.str());
+        if (ctx)
+            return ctx;
+
+        ctx.reset(new RenderContext(width, height));
+        ctx->pool = &m_pool;
+        ctx->kernel = m_options.kernel;
+        ctx->visibility = m_options.visibility;
+        ctx->samples = m_options.samples;
+        m_contexts.insert(key.str(), ctx);
+        return ctx;
+    }
+
+    bool write_output(const std::string &path, RenderContext &ctx, std::string &error)
+    {
+        // a frame reused by abcrender may be a link to another one's image
+        unlink(path.c_str());
+
+        if (native_image_format(path)) {
+            if (!write_image(path, &ctx.data[0], ctx.width(), ctx.height(), m_options.write_options)) {
+                error = "writing " + path;
+                return false;
+            }
+            return true;
+        }
+
+        Magick::Image image;
+        image.read(ctx.width(), ctx.height(), "RGBA", Magick::FloatPixel, &ctx.data[0]);
+        image.flip();
+        image.depth(8);
+        image.write(path);
+        return true;
+    }
+
+    RenderOptions m_options;
+    std::unique_ptr<SampleCache> m_sample_cache;
+    WarmCache<Scene> m_scenes;
+    WarmCache<LoadedTexture> m_textures;
+    WarmCache<RenderContext> m_contexts;
+    // the calling thread takes part in rasterizing too
+    ThreadPool m_pool;
+};
+
+// removes a socket left behind by a server that is gone. Anything else at
+// the path, or a socket someone still listens on, is left alone.
+static bool remove_stale_socket(const struct sockaddr_un &address)
+{
+    struct stat info;
+    if (lstat(address.sun_path, &info) != 0)
+        return errno == ENOENT;
+
+    if (!S_ISSOCK(info.st_mode)) {
+        std::cerr << address.sun_path << " exists and is not a socket" << std::endl;
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "error creating socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool listening = connect(fd, (const struct sockaddr*)&address, sizeof(address)) == 0;
+    close(fd);
+
+    if (listening) {
+        std::cerr << "another server is listening on " << address.sun_path << std::endl;
+        return false;
+    }
+    unlink(address.sun_path);
+    return true;
+}
+
+int render_server(const std::string &socket_path,
+                  const RenderOptions &options)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "socket path too long: " << socket_path << std::endl;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    if (!remove_stale_socket(address))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "error creating socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        std::cerr << "error listening on " << socket_path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    std::cerr << "listening on " << socket_path << std::endl;
+
+    // requests are answered one at a time, every render already uses all
+    // the threads. Each connection with a whole request gets one answered in
+    // turn, so a client that keeps its connection open or sends nothing
+    // holds up nobody.
+    RenderServer server(options);
+    std::list<std::unique_ptr<Connection> > connections;
+    std::vector<struct pollfd> polled;
+    std::vector<std::string> lines;
+    for (;;) {
+        polled.resize(1);
+        polled[0].fd = fd;
+        polled[0].events = POLLIN;
+        polled[0].revents = 0;
+        for (std::list<std::unique_ptr<Connection> >::iterator i = connections.begin();
+                i != connections.end(); i++) {
+            struct pollfd client = {(*i)->fd(), POLLIN, 0};
+            polled.push_back(client);
+        }
+
+        // don't wait while requests sent together are still to be answered
+        bool queued = false;
+        for (std::list<std::unique_ptr<Connection> >::iterator i = connections.begin();
+                i != connections.end(); i++)
+            queued |= (*i)->has_request();
+
+        if (poll(&polled[0], polled.size(), queued ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "error waiting for requests: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        // requests already in a buffer are answered before reading more
+        size_t index = 1;
+        for (std::list<std::unique_ptr<Connection> >::iterator i = connections.begin();
+                i != connections.end(); index++) {
+            Connection &connection = **i;
+            bool open = !polled[index].revents || connection.receive();
+            if (open && connection.take_request(lines))
+                open = server.serve(connection, lines);
+
+            if (open)
+                i++;
+            else
+                i = connections.erase(i);
+        }
+
+        if (polled[0].revents) {
+            int client = accept(fd, NULL, NULL);
+            if (client < 0 && errno != EINTR && errno != ECONNABORTED) {
+                std::cerr << "error accepting a connection: " << strerror(errno) << std::endl;
+                break;
+            }
+            if (client >= 0 && connections.size() >= SERVER_CONNECTIONS) {
+                std::cerr << "too many connections, turning one away" << std::endl;
+                close(client);
+            } else if (client >= 0) {
+                connections.push_back(std::unique_ptr<Connection>(new Connection(client)));
+            }
+        }
+    }
+
+    connections.clear();
+    close(fd);
+    unlink(socket_path.c_str());
+    return -1;
+}
@@ -0,0 +1,31 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "abcrender.h"
+
+#include <string>
+
+// listens on a unix socket at socket_path and renders single frames on
+// request, keeping the last few archives, textures and render contexts
+// between requests. options holds the defaults of every request. Only a
+// socket nobody listens on is replaced at socket_path. Connections take
+// turns, one request each.
+//
+// A request is "key value" lines ended by an empty line:
+//   archive shot.abc      required
+//   frame 1001            required
+//   output out.png|shm    required, shm for the pixels in shared memory
+//   size 1920x1080        [default: from options]
+//   texture tex.png       [default: from options]
+//   lighting 0|1          [default: from options]
+// and gets one reply line:
+//   ok path out.png
+//   ok shm /name width height
+//   error message
+// Shared memory holds width * height rgba floats, bottom row first. It is
+// unlinked with the next request on the connection or when it closes, so
+// map it before sending another one.
+int render_server(const std::string &socket_path,
+                  const RenderOptions &options);
+
+#endif // SERVER_H
@@ -0,0 +1,68 @@
+#ifndef SHADING_H
+#define SHADING_H
+
+#include <glm/glm.hpp>
+#include <cmath>
+
+// the pixel loops are templates over these, so each variant only
+// interpolates the attributes it uses.
+struct FlatShading
+{
+    static const bool textured = false;
+    static const bool lit = false;
+    static const bool visibility = false;
+};
+
+struct TexturedShading
+{
+    static const bool textured = true;
+    static const bool lit = false;
+    static const bool visibility = false;
+};
+
+struct LitShading
+{
+    static const bool textured = false;
+    static const bool lit = true;
+    static const bool visibility = false;
+};
+
+struct TexturedLitShading
+{
+    static const bool textured = true;
+    static const bool lit = true;
+    static const bool visibility = false;
+};
+
+// only writes depth and the triangle id, RenderContext::resolve() shades
+// the pixels left visible.
+struct VisibilityShading
+{
+    static const bool textured = false;
+    static const bool lit = false;
+    static const bool visibility = true;
+};
+
+enum ShadingMode
+{
+    SHADE_FLAT,
+    SHADE_TEXTURED,
+    SHADE_LIT,
+    SHADE_TEXTURED_LIT,
+    SHADE_VISIBILITY
+};
+
+inline ShadingMode shading_mode(bool textured, bool lit)
+{
+    if (textured)
+        return lit ? SHADE_TEXTURED_LIT : SHADE_TEXTURED;
+    return lit ? SHADE_LIT : SHADE_FLAT;
+}
+
+// headlight along +z
+inline float light_amount(const glm::vec3 &normal)
+{
+    return std::fabs(normal.z) * 0.9f + 0.1f;
+}
+
+#endif // SHADING_H
@@ -0,0 +1,310 @@
+#include "texture.h"
+
+#include <half.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+static int texel_size(TextureFormat format)
+{
+    switch (format) {
+    case TEXTURE_HALF:
+        return 4 * sizeof(half);
+    case TEXTURE_RGBA8:
+        return 4;
+    case TEXTURE_FLOAT:
+    default:
+        return 4 * sizeof(float);
+    }
+}
+
+static inline uint8_t to_byte(float value)
+{
+    if (!(value > 0))
+        return 0;
+    if (value >= 1)
+        return 255;
+    return (uint8_t)(value * 255.0f + 0.5f);
+}
+
+// transparent texels read as black, the same as RenderContext::get_pixel
+static inline float visible(const float *texel, int i)
+{
+    return texel[3] > 0 ? texel[i] : 0.0f;
+}
+
+// box filtered in float, odd sizes repeat their last row and column
+static void downsample(const float *src, int width, int height, std::vector<float> &dst)
+{
+    int dst_width = std::max(width / 2, 1);
+    int dst_height = std::max(height / 2, 1);
+    dst.resize((size_t)dst_width * dst_height * 4);
+
+    for (int y = 0; y < dst_height; y++) {
+        int y0 = std::min(y * 2, height - 1);
+        int y1 = std::min(y * 2 + 1, height - 1);
+        for (int x = 0; x < dst_width; x++) {
+            int x0 = std::min(x * 2, width - 1);
+            int x1 = std::min(x * 2 + 1, width - 1);
+            const float *a = &src[((size_t)x0 + (size_t)y0 * width) * 4];
+            const float *b = &src[((size_t)x1 + (size_t)y0 * width) * 4];
+            const float *c = &src[((size_t)x0 + (size_t)y1 * width) * 4];
+            const float *d = &src[((size_t)x1 + (size_t)y1 * width) * 4];
+            float *p = &dst[((size_t)x + (size_t)y * dst_width) * 4];
+            for (int i = 0; i < 4; i++)
+                p[i] = (visible(a, i) + visible(b, i) + visible(c, i) + visible(d, i)) * 0.25f;
+        }
+    }
+}
+
+// level 0 comes straight from rgba and the mips from quarter size scratch
+// buffers, a texture never needs a second full size float copy
+Texture::Texture(const float *rgba, int width, int height, TextureFormat format)
+{
+    m_format = format;
+    m_texel_size = texel_size(format);
+
+    m_levels.push_back(Level());
+    store_level(m_levels.back(), rgba, width, height);
+
+    std::vector<float> src;
+    std::vector<float> dst;
+    const float *level = rgba;
+    while (width > 1 || height > 1) {
+        downsample(level, width, height, dst);
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+
+        m_levels.push_back(Level());
+        store_level(m_levels.back(), &dst[0], width, height);
+
+        src.swap(dst);
+        level = &src[0];
+    }
+}
+
+void Texture::store_level(Level &level, const float *rgba, int width, int height)
+{
+    level.width = width;
+    level.height = height;
+
+    int padded_width = width + TEXTURE_BORDER * 3;
+    int padded_height = height + TEXTURE_BORDER * 3;
+    level.tiles_x = (padded_width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+    int tiles_y = (padded_height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+    level.texels.assign((size_t)level.tiles_x * tiles_y * TEXTURE_TILE * TEXTURE_TILE * m_texel_size, 0);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float *src = &rgba[((size_t)x + (size_t)y * width) * 4];
+            unsigned char *dst = texel(level, x + TEXTURE_BORDER, y + TEXTURE_BORDER);
+
+            switch (m_format) {
+            case TEXTURE_FLOAT:
+                for (int i = 0; i < 4; i++) {
+                    float value = visible(src, i);
+                    memcpy(dst + i * sizeof(float), &value, sizeof(float));
+                }
+                break;
+            case TEXTURE_HALF:
+                for (int i = 0; i < 4; i++) {
+                    half value(visible(src, i));
+                    memcpy(dst + i * sizeof(half), &value, sizeof(half));
+                }
+                break;
+            case TEXTURE_RGBA8:
+                for (int i = 0; i < 4; i++)
+                    dst[i] = to_byte(visible(src, i));
+                break;
+            }
+        }
+    }
+}
+
+size_t Texture::memory_size() const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < m_levels.size(); i++)
+        size += m_levels[i].texels.size();
+    return size;
+}
+
+inline unsigned char *Texture::texel(Level &level, int x, int y) const
+{
+    // x and y are in padded coordinates, never negative
+    unsigned int tile = (x >> TEXTURE_TILE_SHIFT) + (y >> TEXTURE_TILE_SHIFT) * level.tiles_x;
+    unsigned int offset = (x & (TEXTURE_TILE - 1)) + ((y & (TEXTURE_TILE - 1)) << TEXTURE_TILE_SHIFT);
+    return &level.texels[((size_t)(tile << (TEXTURE_TILE_SHIFT * 2)) + offset) * m_texel_size];
+}
+
+inline const unsigned char *Texture::texel(const Level &level, int x, int y) const
+{
+    unsigned int tile = (x >> TEXTURE_TILE_SHIFT) + (y >> TEXTURE_TILE_SHIFT) * level.tiles_x;
+    unsigned int offset = (x & (TEXTURE_TILE - 1)) + ((y & (TEXTURE_TILE - 1)) << TEXTURE_TILE_SHIFT);
+    return &level.texels[((size_t)(tile << (TEXTURE_TILE_SHIFT * 2)) + offset) * m_texel_size];
+}
+
+// log2 from the float's exponent, the mantissa is taken as linear. Plenty
+// for picking a mip level.
+static inline float approx_log2(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    float exponent = (float)((int)((bits >> 23) & 0xff) - 127);
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float mantissa;
+    memcpy(&mantissa, &bits, sizeof(mantissa));
+    return exponent + mantissa - 1.0f;
+}
+
+float Texture::lod(float dudx, float dvdx, float dudy, float dvdy) const
+{
+    float sx = (float)(width() - 1);
+    float sy = (float)(height() - 1);
+    dudx *= sx;
+    dudy *= sx;
+    dvdx *= sy;
+    dvdy *= sy;
+
+    float rho = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+    // also catches NaN
+    if (!(rho > 1.0f))
+        return 0;
+    return 0.5f * approx_log2(rho);
+}
+
+#ifdef HAVE_SSE2
+
+template <TextureFormat Format>
+static inline __m128 load_texel(const unsigned char *p);
+
+template <>
+inline __m128 load_texel<TEXTURE_FLOAT>(const unsigned char *p)
+{
+    return _mm_loadu_ps((const float*)p);
+}
+
+template <>
+inline __m128 load_texel<TEXTURE_HALF>(const unsigned char *p)
+{
+    half h[4];
+    memcpy(h, p, sizeof(h));
+    return _mm_setr_ps(h[0], h[1], h[2], h[3]);
+}
+
+template <>
+inline __m128 load_texel<TEXTURE_RGBA8>(const unsigned char *p)
+{
+    int32_t bits;
+    memcpy(&bits, p, sizeof(bits));
+    __m128i zero = _mm_setzero_si128();
+    __m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.0f / 255.0f));
+}
+
+template <TextureFormat Format>
+glm::vec4 Texture::sample_level(const Level &level, float u, float v) const
+{
+    // the border covers -1 .. width, further out only reads transparent
+    // black, the same as the border itself.
+    float x = std::max(-1.0f, std::min(u * ((float)level.width - 1), (float)level.width));
+    float y = std::max(-1.0f, std::min(v * ((float)level.height - 1), (float)level.height));
+
+    int px = (int)(x); //floor
+    int py = (int)(y); //floor
+
+    float fx = x - px;
+    float fy = y - py;
+    float fx1 = 1.0f - fx;
+    float fy1 = 1.0f - fy;
+
+    px += TEXTURE_BORDER;
+    py += TEXTURE_BORDER;
+
+    __m128 c0 = load_texel<Format>(texel(level, px + 0, py + 0));
+    __m128 c1 = load_texel<Format>(texel(level, px + 1, py + 0));
+    __m128 c2 = load_texel<Format>(texel(level, px + 0, py + 1));
+    __m128 c3 = load_texel<Format>(texel(level, px + 1, py + 1));
+
+    // summed in the same order as the scalar filter
+    __m128 color = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(fx1 * fy1)),
+                                                    _mm_mul_ps(c1, _mm_set1_ps(fx  * fy1))),
+                                         _mm_mul_ps(c2, _mm_set1_ps(fx1 * fy))),
+                              _mm_mul_ps(c3, _mm_set1_ps(fx  * fy)));
+
+    glm::vec4 result;
+    _mm_storeu_ps(&result[0], color);
+    return result;
+}
+
+#else
+
+template <TextureFormat Format>
+static inline glm::vec4 load_texel(const unsigned char *p)
+{
+    glm::vec4 c;
+    for (int i = 0; i < 4; i++) {
+        if (Format == TEXTURE_FLOAT) {
+            memcpy(&c[i], p + i * sizeof(float), sizeof(float));
+        } else if (Format == TEXTURE_HALF) {
+            half h;
+            memcpy(&h, p + i * sizeof(half), sizeof(half));
+            c[i] = h;
+        } else {
+            c[i] = p[i] * (1.0f / 255.0f);
+        }
+    }
+    return c;
+}
+
+template <TextureFormat Format>
+glm::vec4 Texture::sample_level(const Level &level, float u, float v) const
+{
+    float x = std::max(-1.0f, std::min(u * ((float)level.width - 1), (float)level.width));
+    float y = std::max(-1.0f, std::min(v * ((float)level.height - 1), (float)level.height));
+
+    int px = (int)(x); //floor
+    int py = (int)(y); //floor
+
+    float fx = x - px;
+    float fy = y - py;
+    float fx1 = 1.0f - fx;
+    float fy1 = 1.0f - fy;
+
+    px += TEXTURE_BORDER;
+    py += TEXTURE_BORDER;
+
+    glm::vec4 c0 = load_texel<Format>(texel(level, px + 0, py + 0));
+    glm::vec4 c1 = load_texel<Format>(texel(level, px + 1, py + 0));
+    glm::vec4 c2 = load_texel<Format>(texel(level, px + 0, py + 1));
+    glm::vec4 c3 = load_texel<Format>(texel(level, px + 1, py + 1));
+
+    return c0 * (fx1 * fy1) + c1 * (fx * fy1) + c2 * (fx1 * fy) + c3 * (fx * fy);
+}
+
+#endif
+
+glm::vec4 Texture::sample(float u, float v, float lod) const
+{
+    int index = 0;
+    if (lod > 0.5f)
+        index = std::min((int)(lod + 0.5f), levels() - 1);
+    const Level &level = m_levels[index];
+
+    switch (m_format) {
+    case TEXTURE_HALF:
+        return sample_level<TEXTURE_HALF>(level, u, v);
+    case TEXTURE_RGBA8:
+        return sample_level<TEXTURE_RGBA8>(level, u, v);
+    case TEXTURE_FLOAT:
+    default:
+        return sample_level<TEXTURE_FLOAT>(level, u, v);
+    }
+}
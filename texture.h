@@ -0,0 +1,66 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <vector>
+
+// texels are stored in TEXTURE_TILE squares so a bilinear footprint
+// mostly stays within one or two cache lines.
+#define TEXTURE_TILE_SHIFT 2
+#define TEXTURE_TILE (1 << TEXTURE_TILE_SHIFT)
+
+// every level has a transparent black border, one texel before and two
+// after, so lookups clamp their coordinates instead of testing them.
+#define TEXTURE_BORDER 1
+
+enum TextureFormat
+{
+    TEXTURE_FLOAT,
+    TEXTURE_HALF,
+    TEXTURE_RGBA8
+};
+
+class Texture
+{
+public:
+    // rgba rows are stored bottom up like RenderContext::data
+    Texture(const float *rgba, int width, int height, TextureFormat format);
+
+    int width() const {return m_levels[0].width;}
+    int height() const {return m_levels[0].height;}
+    int levels() const {return (int)m_levels.size();}
+    TextureFormat format() const {return m_format;}
+
+    // bytes used by all the levels
+    size_t memory_size() const;
+
+    // mip level from the screen space derivatives of uv
+    float lod(float dudx, float dvdx, float dudy, float dvdy) const;
+
+    // bilinear lookup on the mip level nearest to lod, texels outside the
+    // image are transparent black.
+    glm::vec4 sample(float u, float v, float lod) const;
+
+private:
+    struct Level
+    {
+        int width;
+        int height;
+        int tiles_x;
+        std::vector<unsigned char> texels;
+    };
+
+    void store_level(Level &level, const float *rgba, int width, int height);
+    template <TextureFormat Format>
+    glm::vec4 sample_level(const Level &level, float u, float v) const;
+
+    unsigned char *texel(Level &level, int x, int y) const;
+    const unsigned char *texel(const Level &level, int x, int y) const;
+
+    TextureFormat m_format;
+    int m_texel_size;
+    std::vector<Level> m_levels;
+};
+
+#endif // TEXTURE_H
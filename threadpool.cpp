@@ -0,0 +1,108 @@
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(int threads)
+{
+    m_quit = false;
+    for (int i = 0; i < threads; i++) {
+        m_threads.push_back(std::thread(&ThreadPool::worker, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        m_threads[i].join();
+    }
+}
+
+void ThreadPool::run(const std::function<void()> &job)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+    }
+    m_cond.notify_one();
+}
+
+void ThreadPool::worker()
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_quit && m_jobs.empty())
+                m_cond.wait(lock);
+
+            if (m_jobs.empty())
+                return;
+
+            job = m_jobs.front();
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
+
+struct ParallelFor
+{
+    std::function<void(int)> func;
+    int count;
+    std::atomic<int> next;
+    std::atomic<int> done;
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    void work()
+    {
+        int i;
+        while ((i = next++) < count) {
+            func(i);
+            if (++done == count) {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.notify_all();
+            }
+        }
+    }
+};
+
+void ThreadPool::parallel_for(int count, const std::function<void(int)> &func)
+{
+    if (count <= 0)
+        return;
+
+    if (count == 1 || m_threads.empty()) {
+        for (int i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+
+    // helpers that start after all the work is taken just return, so the
+    // shared state has to outlive this call.
+    std::shared_ptr<ParallelFor> state(new ParallelFor());
+    state->func = func;
+    state->count = count;
+    state->next = 0;
+    state->done = 0;
+
+    int helpers = std::min(count - 1, (int)m_threads.size());
+    for (int i = 0; i < helpers; i++) {
+        run([state]() { state->work(); });
+    }
+
+    // the caller always helps, this keeps nested parallel_for calls from
+    // deadlocking when every worker is busy.
+    state->work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (state->done < count)
+        state->cond.wait(lock);
+}
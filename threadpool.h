@@ -0,0 +1,34 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    ThreadPool(int threads);
+    ~ThreadPool();
+
+    // number of threads that take part in parallel_for, including the caller
+    int size() const {return (int)m_threads.size() + 1;}
+
+    // runs func(0) .. func(count-1) on the pool and the calling thread,
+    // returns once every index has finished.
+    void parallel_for(int count, const std::function<void(int)> &func);
+    void run(const std::function<void()> &job);
+
+private:
+    void worker();
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()> > m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_quit;
+};
+
+#endif // THREADPOOL_H
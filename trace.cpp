@@ -0,0 +1,124 @@
+#include "trace.h"
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+// small stable ids read better in the trace viewer than hashed thread ids
+static int thread_index()
+{
+    static std::atomic<int> next(1);
+    static thread_local int index = 0;
+    if (!index)
+        index = next++;
+    return index;
+}
+
+static void write_string(std::ostream &out, const std::string &str)
+{
+    out << '"';
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c
+                << std::dec << std::setfill(' ');
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+Trace::Trace()
+{
+    m_start = std::chrono::steady_clock::now();
+}
+
+double Trace::now() const
+{
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - m_start;
+    return elapsed.count();
+}
+
+void Trace::span(const char *name, int frame, double start, double end,
+                 const std::string &detail, const TraceValues &values)
+{
+    Event event;
+    event.phase = 'X';
+    event.name = name;
+    event.detail = detail;
+    event.frame = frame;
+    event.thread = thread_index();
+    event.start = start;
+    event.duration = end - start;
+    event.values = values;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_events.push_back(event);
+}
+
+void Trace::counter(const char *name, int frame, const TraceValues &values)
+{
+    Event event;
+    event.phase = 'C';
+    event.name = name;
+    event.frame = frame;
+    event.thread = thread_index();
+    event.start = now();
+    event.duration = 0;
+    event.values = values;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_events.push_back(event);
+}
+
+bool Trace::write(const std::string &path) const
+{
+    std::ofstream out(path.c_str());
+    if (!out) {
+        std::cerr << "error opening trace file: " << path << std::endl;
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < m_events.size(); i++) {
+        const Event &event = m_events[i];
+        out << "{\"ph\": \"" << event.phase << "\", \"name\": ";
+        write_string(out, event.name);
+        out << ", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << event.start;
+        if (event.phase == 'X')
+            out << ", \"dur\": " << event.duration;
+
+        // counter args are plotted, so the frame only goes on spans
+        out << ", \"args\": {";
+        const char *separator = "";
+        if (event.phase == 'X') {
+            out << "\"frame\": " << event.frame;
+            separator = ", ";
+            if (!event.detail.empty()) {
+                out << separator << "\"detail\": ";
+                write_string(out, event.detail);
+            }
+        }
+        for (size_t k = 0; k < event.values.size(); k++) {
+            out << separator;
+            write_string(out, event.values[k].first);
+            out << ": " << std::setprecision(0) << event.values[k].second << std::setprecision(3);
+            separator = ", ";
+        }
+        out << "}}" << (i + 1 < m_events.size() ? "," : "") << "\n";
+    }
+    out << "]}\n";
+
+    if (!out) {
+        std::cerr << "error writing trace file: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
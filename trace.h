@@ -0,0 +1,75 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::vector<std::pair<std::string, double> > TraceValues;
+
+// collects timed spans and counters from any thread and writes them in
+// the chrome trace event format, load the file in chrome://tracing or
+// ui.perfetto.dev.
+class Trace
+{
+public:
+    Trace();
+
+    // microseconds since the trace was created
+    double now() const;
+
+    void span(const char *name, int frame, double start, double end,
+              const std::string &detail = std::string(),
+              const TraceValues &values = TraceValues());
+    void counter(const char *name, int frame, const TraceValues &values);
+
+    bool write(const std::string &path) const;
+
+private:
+    struct Event
+    {
+        char phase;
+        const char *name;
+        std::string detail;
+        int frame;
+        int thread;
+        double start;
+        double duration;
+        TraceValues values;
+    };
+
+    std::chrono::steady_clock::time_point m_start;
+    mutable std::mutex m_mutex;
+    std::vector<Event> m_events;
+};
+
+// records a span from construction to destruction, nothing without a trace
+class TraceSpan
+{
+public:
+    TraceSpan(Trace *trace, const char *name, int frame) :
+        m_trace(trace),
+        m_name(name),
+        m_frame(frame),
+        m_start(trace ? trace->now() : 0)
+    {}
+
+    ~TraceSpan()
+    {
+        if (m_trace)
+            m_trace->span(m_name, m_frame, m_start, m_trace->now(), m_detail);
+    }
+
+    void set_detail(const std::string &detail) {m_detail = detail;}
+
+private:
+    Trace *m_trace;
+    const char *m_name;
+    int m_frame;
+    double m_start;
+    std::string m_detail;
+};
+
+#endif // TRACE_H
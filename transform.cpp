@@ -0,0 +1,99 @@
+#include "transform.h"
+#include "clip.h"
+
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+static inline void transform_point(const glm::mat4 &mat, const float *p,
+                                   float width, float height,
+                                   glm::vec4 &out, unsigned char &code)
+{
+    out = transform_position(mat, p[0], p[1], p[2]);
+    code = clip_code(out, width, height);
+    out.x /= out.w;
+    out.y /= out.w;
+    out.z /= out.w;
+}
+
+#ifdef HAVE_SSE2
+// 4 points at a time, the sums are done in the same order as
+// transform_position() so the result matches transform_point exactly.
+static size_t transform_points_sse2(const glm::mat4 &mat, const float *points, size_t count,
+                                    float width, float height,
+                                    glm::vec4 *out, unsigned char *codes)
+{
+    __m128 m[4][4];
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++)
+            m[c][r] = _mm_set1_ps(mat[c][r]);
+    }
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 guard = _mm_set1_ps(GUARD_BAND);
+    const __m128 right = _mm_set1_ps(width + GUARD_BAND);
+    const __m128 top = _mm_set1_ps(height + GUARD_BAND);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const float *p = points + i * 3;
+        __m128 a = _mm_loadu_ps(p);
+        __m128 b = _mm_loadu_ps(p + 4);
+        __m128 c = _mm_loadu_ps(p + 8);
+
+        // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3 to x, y and z rows
+        __m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 1, 0, 2));
+        __m128 x = _mm_shuffle_ps(a, t, _MM_SHUFFLE(2, 0, 3, 0));
+        t = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));
+        __m128 u = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3));
+        __m128 y = _mm_shuffle_ps(t, u, _MM_SHUFFLE(2, 0, 2, 0));
+        t = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));
+        u = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));
+        __m128 z = _mm_shuffle_ps(t, u, _MM_SHUFFLE(2, 0, 2, 0));
+
+        __m128 r[4];
+        for (int k = 0; k < 4; k++) {
+            r[k] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][k], x),
+                                                    _mm_mul_ps(m[1][k], y)),
+                                         _mm_mul_ps(m[2][k], z)),
+                              m[3][k]);
+        }
+
+        // the same distances clip_code() tests
+        int outside[CLIP_PLANES];
+        outside[0] = _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(r[2], r[3]), zero));
+        outside[1] = _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(r[0], _mm_mul_ps(guard, r[3])), zero));
+        outside[2] = _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(_mm_mul_ps(right, r[3]), r[0]), zero));
+        outside[3] = _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(r[1], _mm_mul_ps(guard, r[3])), zero));
+        outside[4] = _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(_mm_mul_ps(top, r[3]), r[1]), zero));
+        for (int k = 0; k < 4; k++) {
+            unsigned char code = 0;
+            for (int plane = 0; plane < CLIP_PLANES; plane++)
+                code |= ((outside[plane] >> k) & 1) << plane;
+            codes[i + k] = code;
+        }
+
+        r[0] = _mm_div_ps(r[0], r[3]);
+        r[1] = _mm_div_ps(r[1], r[3]);
+        r[2] = _mm_div_ps(r[2], r[3]);
+
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+        for (int k = 0; k < 4; k++)
+            _mm_storeu_ps(&out[i + k].x, r[k]);
+    }
+    return i;
+}
+#endif
+
+void transform_points(const glm::mat4 &mat, const float *points, size_t count,
+                      float width, float height,
+                      glm::vec4 *out, unsigned char *codes)
+{
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    i = transform_points_sse2(mat, points, count, width, height, out, codes);
+#endif
+    for (; i < count; i++)
+        transform_point(mat, points + i * 3, width, height, out[i], codes[i]);
+}
@@ -0,0 +1,22 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <glm/glm.hpp>
+#include <cstddef>
+
+// mat * (x, y, z, 1) summed as ((m0 x + m1 y) + m2 z) + m3. glm's operator
+// groups the sum differently between versions, everything that has to
+// match transform_points() uses this instead.
+inline glm::vec4 transform_position(const glm::mat4 &mat, float x, float y, float z)
+{
+    return ((mat[0] * x + mat[1] * y) + mat[2] * z) + mat[3];
+}
+
+// out = transform_position() with x, y and z divided by w, the same for
+// every point whether it goes through the SSE2 path or not. points is packed
+// xyz. codes gets each point's clip_code() for a width x height viewport.
+void transform_points(const glm::mat4 &mat, const float *points, size_t count,
+                      float width, float height,
+                      glm::vec4 *out, unsigned char *codes);
+
+#endif // TRANSFORM_H